@@ -0,0 +1,231 @@
+/*------------------------------------------------------------------------
+ Module:        FLYSCAN.CPP
+ Project:       StepperMotor
+ Description:   Fly scanning with position-triggered acquisitions.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <thread>
+
+#include "flyscan.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define FLY_REPLY_MS  1000 // wait for a setting or position reply
+#define FLY_FIX_S     0.1  // cruise before the first trigger, for a position fix
+#define FLY_SPIN_S    0.002 // final approach to a trigger is slept, not pumped
+
+static double Since(Clock::time_point start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+FlyScanner::FlyScanner(XYStage& stage, const MotionModel& motion)
+	: Stage(stage), Motion(motion), NormalSpeed(0), DriveAccel(motion.Axis[MOTION_X].Accel), FixCount(0),
+	  Length(0.0), Peak(1.0), Accel(1.0), Offset(0.0)
+{
+}
+
+bool FlyScanner::Begin(unsigned long timeoutMs)
+{
+	ZaberLink& zaber = Stage.Link();
+	unsigned char xUnit = Stage.XAxisUnit();
+	vector<future<long>> replies = zaber.RequestMany({{xUnit, ZABER_RETURNSETTING, ZABER_SETTARGETSPEED},
+		{xUnit, ZABER_RETURNSETTING, ZABER_SETACCELERATION}});
+	try
+	{
+		if (zaber.AwaitAll(replies, timeoutMs))
+		{
+			NormalSpeed = replies[0].get();
+			long accel = replies[1].get();
+			if (accel > 0)
+			{
+				DriveAccel = accel / ZABER_ACCELSCALE;
+			}
+			return true;
+		}
+	}
+	catch (const ZaberError& e)
+	{
+		cout << e.what() << endl;
+	}
+	zaber.CancelAll();
+	return false;
+}
+
+long FlyScanner::RunUp(double velocity) const
+{
+	return lround(velocity * velocity / (2.0 * DriveAccel) + velocity * FLY_FIX_S);
+}
+
+double FlyScanner::SecondsAt(double distance) const
+{
+	double rampDist = Peak * Peak / (2.0 * Accel);
+	double ramp = Peak / Accel;
+	double total = 2.0 * ramp + (Length - 2.0 * rampDist) / Peak;
+	distance = max(0.0, min(Length, distance));
+	if (distance <= rampDist)
+	{
+		return sqrt(2.0 * distance / Accel);
+	}
+	if (distance <= Length - rampDist)
+	{
+		return ramp + (distance - rampDist) / Peak;
+	}
+	return total - sqrt(2.0 * (Length - distance) / Accel);
+}
+
+double FlyScanner::DistanceAt(double seconds) const
+{
+	double rampDist = Peak * Peak / (2.0 * Accel);
+	double ramp = Peak / Accel;
+	double total = 2.0 * ramp + (Length - 2.0 * rampDist) / Peak;
+	if (seconds <= 0.0)
+	{
+		return 0.0;
+	}
+	if (seconds <= ramp)
+	{
+		return 0.5 * Accel * seconds * seconds;
+	}
+	if (seconds <= total - ramp)
+	{
+		return rampDist + Peak * (seconds - ramp);
+	}
+	if (seconds < total)
+	{
+		double left = total - seconds;
+		return Length - 0.5 * Accel * left * left;
+	}
+	return Length;
+}
+
+double FlyScanner::Fix(long from, Clock::time_point start)
+{
+	ZaberLink& zaber = Stage.Link();
+	double asked = Since(start);
+	future<long> reply = zaber.Request(Stage.XAxisUnit(), ZABER_RETURNPOS, 0);
+	try
+	{
+		if (!zaber.Await(reply, FLY_REPLY_MS))
+		{
+			return -1.0;
+		}
+		double answered = Since(start);
+		double distance = fabs((double)reply.get() - from);
+		// Only a fix at cruise speed pins the time well; in the ramps a
+		// small position error is a large time error
+		double rampDist = Peak * Peak / (2.0 * Accel);
+		if (distance > rampDist && distance < Length - rampDist)
+		{
+			Offset = 0.5 * (asked + answered) - SecondsAt(distance);
+			FixCount++;
+		}
+		return answered - asked;
+	}
+	catch (const ZaberError& e)
+	{
+		cout << e.what() << endl;
+	}
+	return -1.0;
+}
+
+MoveResult FlyScanner::Sweep(long y, long from, long to, const vector<long>& triggers, double velocity,
+	const function<void(size_t)>& acquire, vector<FlySample>& samples)
+{
+	ZaberLink& zaber = Stage.Link();
+	unsigned char xUnit = Stage.XAxisUnit();
+	MoveResult result = {false, to, y, 0.0, -1.0, -1.0};
+
+	Length = fabs((double)to - from);
+	Accel = DriveAccel;
+	Peak = min(velocity, sqrt(Length * Accel));
+	Offset = 0.0;
+	double direction = to >= from ? 1.0 : -1.0;
+
+	Stage.ForgetSettings();
+	future<long> speedSet = zaber.Request(xUnit, ZABER_SETTARGETSPEED, lround(velocity * ZABER_SPEEDSCALE));
+	if (!zaber.Await(speedSet, FLY_REPLY_MS))
+	{
+		cout << "Warning: the X drive did not take the sweep speed" << endl;
+		zaber.CancelAll();
+		return result;
+	}
+
+	Clock::time_point start = Clock::now();
+	future<long> sweep = zaber.Request(xUnit, ZABER_MOVEABSOLUTE, to);
+	double fixSeconds = 0.0; // last position query round trip
+	for (size_t i = 0; i < triggers.size(); i++)
+	{
+		double distance = fabs((double)triggers[i] - from);
+		bool fixedThisGap = false;
+		for (;;)
+		{
+			double now = Since(start);
+			double slack = Offset + SecondsAt(distance) - now;
+			if (slack <= 0.0)
+			{
+				break;
+			}
+			// Re-anchor once per gap between triggers when there is room
+			// for the query, and only once the ramp is over
+			if (!fixedThisGap && now - Offset > Peak / Accel && slack > 2.0 * fixSeconds + FLY_SPIN_S)
+			{
+				fixedThisGap = true;
+				double took = Fix(from, start);
+				if (took >= 0.0)
+				{
+					fixSeconds = took;
+				}
+				continue;
+			}
+			if (slack > FLY_SPIN_S)
+			{
+				// Waiting on the link also takes in any early replies
+				zaber.Pump((unsigned long)((slack - FLY_SPIN_S) * 1000.0));
+			}
+			else
+			{
+				this_thread::sleep_for(chrono::duration<double>(slack));
+			}
+		}
+		double acquired = Since(start);
+		acquire(i);
+		samples.push_back(FlySample{i, acquired, lround(from + direction * DistanceAt(acquired - Offset))});
+	}
+
+	// The move-absolute reply ends the sweep
+	double left = Offset + SecondsAt(Length) - Since(start);
+	unsigned long waitMs = (unsigned long)(max(0.0, left + Motion.MarginSeconds()) * 1000.0) + FLY_REPLY_MS;
+	try
+	{
+		if (zaber.Await(sweep, waitMs))
+		{
+			result.X = sweep.get();
+			result.Arrived = true;
+			result.XSeconds = Since(start);
+		}
+	}
+	catch (const ZaberError& e)
+	{
+		cout << e.what() << endl;
+	}
+	if (!result.Arrived)
+	{
+		zaber.CancelAll();
+	}
+	result.Seconds = Since(start);
+
+	// Back to full speed for the moves between rows
+	future<long> restored = zaber.Request(xUnit, ZABER_SETTARGETSPEED, NormalSpeed);
+	if (!zaber.Await(restored, FLY_REPLY_MS))
+	{
+		cout << "Warning: the X drive did not take back its normal speed" << endl;
+		zaber.CancelAll();
+	}
+	return result;
+}
@@ -0,0 +1,74 @@
+/*------------------------------------------------------------------------
+ Module:        FLYSCAN.H
+ Project:       StepperMotor
+ Description:   Fly scanning: the X drive sweeps a row at a constant
+                speed and acquisitions are started as it crosses each
+                trigger position, instead of stopping at every point.
+                Crossing times come from the motion model's profile,
+                re-anchored on position fixes taken during the sweep.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _FLYSCAN_H_
+#define _FLYSCAN_H_
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include "motionmodel.h"
+#include "xystage.h"
+
+struct FlySample
+{
+	size_t Index;   // trigger the acquisition belongs to
+	double Seconds; // from the sweep command to the start of the acquisition
+	long X;         // where the X drive is estimated to have been then
+};
+
+class FlyScanner
+{
+public:
+	FlyScanner(XYStage& stage, const MotionModel& motion);
+
+	// Reads the X drive's target speed, put back after every sweep, and
+	// its acceleration, which the sweeps are timed on: an earlier
+	// profiled run may have left it away from the fitted value.
+	// Returns false if the drive does not answer.
+	bool Begin(unsigned long timeoutMs);
+
+	// X travel needed before the first trigger to reach the sweep speed
+	// and take a position fix
+	long RunUp(double velocity) const;
+
+	// Sweeps X from `from` (where it must already be) to `to` at
+	// velocity microsteps/s, with Y held at y.  acquire(i) runs as X
+	// crosses triggers[i]; triggers must lie in sweep order.  The result
+	// is that of the X move, for position tracking.
+	MoveResult Sweep(long y, long from, long to, const std::vector<long>& triggers, double velocity,
+		const std::function<void(size_t)>& acquire, std::vector<FlySample>& samples);
+
+	unsigned long Fixes() const { return FixCount; }
+
+private:
+	// Profile of the current sweep, seconds after motion starts
+	double SecondsAt(double distance) const;
+	double DistanceAt(double seconds) const;
+
+	// Asks the X drive where it is and moves the time anchor to match.
+	// Returns the seconds the query took, or a negative value on failure.
+	double Fix(long from, std::chrono::steady_clock::time_point start);
+
+	XYStage& Stage;
+	const MotionModel& Motion;
+	long NormalSpeed;
+	double DriveAccel; // X acceleration setting, microsteps/s^2
+	unsigned long FixCount;
+
+	double Length;   // of the current sweep
+	double Peak;     // its cruise speed
+	double Accel;
+	double Offset;   // seconds from sweep command to motion start
+};
+
+#endif
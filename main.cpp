@@ -1,11 +1,16 @@
 #include <algorithm>
+#include <chrono>
 #include <conio.h>
+#include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <math.h>
+#include <memory>
+#include <set>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,78 +19,30 @@
 #include <vector>
 #include <windows.h>
 
+#include "flyscan.h"
+#include "motionmodel.h"
 #include "phidget21.h"
-#include "pserial.c"
-#include "sicl.h"
+#include "positiontracker.h"
+#include "quadrefine.h"
+#include "scanmask.h"
+#include "scanorder.h"
+#include "scanplan.h"
+#include "scopesession.h"
+#include "settlegate.h"
+#include "tourplanner.h"
+#include "xystage.h"
+#include "zaberascii.h"
+#include "zaberasync.h"
+#include "zaberio.h"
+#include "zaberport.h"
 
 using namespace std;
 
 //!!When compiling link phidget21.lib, sicl32.lib, -lwinmm!!//
+//!!Compile pserial.c, pdecode.c, pcapture.c, flyscan.cpp, motionmodel.cpp, positiontracker.cpp, quadrefine.cpp, scanmask.cpp, scanorder.cpp, scanplan.cpp, scopesession.cpp, settlegate.cpp, tourplanner.cpp, zaberport.cpp, zaberlink.cpp, zaberasync.cpp, zaberascii.cpp, zaberio.cpp and xystage.cpp alongside main.cpp!!//
 //!!Use C++17 and C17!!//
 //!!Static link for all!!//
 
-//------------------------------------------------------------------------
-//FUNCTIONS FOR SCOPE CODE
-//Read in 16 bit data from the return buffer.
-//The short array named buffer is 2 bytes wide, but iread reads
-//one byte at a time.  Therefore, the pointer into buffer is explicitly
-//casted as a character type in the iread function.
-
-INST oscillo;
-
-unsigned long ReadWord (short *buffer, unsigned long BytesToRead)
-{
-	unsigned long BytesRead;
-	int reason;
-
-	iread(oscillo, (char *) buffer, BytesToRead, &reason, &BytesRead);
-
-	return BytesRead;
-
-}
-
-unsigned long ReadByte (char *buffer, unsigned long BytesToRead)
-{
-	unsigned long BytesRead;
-	int reason;
-
-	iread(oscillo,buffer,BytesToRead,&reason,&BytesRead);
-
-	return BytesRead;
-}
-
-void WriteIO(char *buffer)
-{
-	unsigned long actualcnt;
-	unsigned long BytesToWrite;
-	int send_end=1;
-	char temp[50];
-
-	BytesToWrite = strlen(buffer)+1;
-	strcpy_s(temp, buffer);
-	strcat_s(temp, "\n");
-	iwrite(oscillo, temp, BytesToWrite, send_end, &actualcnt);
-
-}
-void ReadIO(char *buffer)
-{
-	unsigned long actualcnt;
-	unsigned long BytesToWrite;
-	int send_end;
-	char temp[50];
-
-	BytesToWrite = strlen(buffer)+1;
-	strcpy_s(temp, buffer);
-	strcat_s(temp, "\n");
-	iread(oscillo, temp, BytesToWrite, &send_end, &actualcnt);
-
-}
-
-void ReadDouble(double *buffer)
-{
-	iscanf(oscillo, "%lf", buffer);
-}
-
 //------------------------------------------------------------------------
 //OTHER FUNCTIONS
 //Read in configurations file and generate a map of parameters
@@ -129,21 +86,44 @@ map<string, double> configParser(string inputFilePath)
 {
 	string line, key, value;
 	ifstream stream(inputFilePath);
-	stringstream splitter;
+
+	// Read by configStrings; every other setting must be a number
+	set<string> textParamNames = {"maskFile", "motionModelFile", "planFile", "pointsFile",
+		"scanOrder", "scanOrderFile", "scopeMeasurements"};
 
 	map<string, double> variables;
 
 	if (stream)
 	{
+		int lineNumber = 0;
 		while (getline(stream, line))
 		{
-			if (line[0] != '#')
+			lineNumber++;
+			stringstream splitter(line);
+			if (line.empty() || line[0] == '#' || !(splitter >> key) || textParamNames.count(key))
+			{
+				continue;
+			}
+			// The whole value must be the number: stod alone would read
+			// "10cm" as 10
+			size_t used = 0;
+			try
+			{
+				if (splitter >> value)
+				{
+					variables[key] = stod(value, &used);
+				}
+			}
+			catch (const invalid_argument&)
+			{
+			}
+			catch (const out_of_range&)
+			{
+			}
+			if (used == 0 || used != value.size())
 			{
-				splitter << line;
-				splitter >> key;
-				splitter >> value;
-				splitter.clear();
-				variables[key] = stod(value);
+				cout << "Error line " << lineNumber << " of " << inputFilePath << " needs a number: " << line << endl;
+				exit(0);
 			}
 		}
 	}
@@ -157,6 +137,27 @@ map<string, double> configParser(string inputFilePath)
 	return variables;
 }
 
+map<string, string> configStrings(string inputFilePath)
+{
+	string line, key, value;
+	ifstream stream(inputFilePath);
+	map<string, string> variables;
+
+	while (getline(stream, line))
+	{
+		if (!line.empty() && line[0] != '#')
+		{
+			stringstream splitter(line);
+			if (splitter >> key >> value)
+			{
+				variables[key] = value;
+			}
+		}
+	}
+
+	return variables;
+}
+
 int checkVarMap(map<string, double> varMap)
 {
 	string configParamNames[] = {"xOriginCm", "xMaxCm", "yOriginCm", "yMaxCm", "nStepsX", "nStepsY"};
@@ -172,8 +173,15 @@ int checkVarMap(map<string, double> varMap)
 	return retVal;
 }
 
+//------------------------------------------------------------------------
+//FUNCTIONS FOR STAGE CODE
+//Replies are awaited in the serial driver; requests to both drives are
+//kept in flight together so their round trips overlap.
+
+const unsigned long replyWaitMs = 1000;
+
 // BEGIN SCAN CODE --------------------------------------------------------
-// All commands follow the structure "PSERIAL_Send( X,Y,Z )" where X is the
+// All commands follow the structure "zaber->Request( X,Y,Z )" where X is the
 // target drive (for several daisy-chained), Y is the Zaber command (20 is
 // move absolute, for instance), and Z is data (microsteps to move for
 // command 20, for instance). All daisy-chained drives must be numbered
@@ -206,19 +214,23 @@ int main(int argc, char* argv[])
 	string filename2 = outputDir + timeStamp + "_VMIN_SIPM1.txt";
 	string filename3 = outputDir + timeStamp + "_VAVG_SIPM1.txt";
 	string filename4 = outputDir + timeStamp + "_TIME.txt";
+	string filename5 = outputDir + timeStamp + "_POSITIONS.txt";
 	ofstream file_1;
 	ofstream file_2;
 	ofstream file_3;
 	ofstream file_4;
+	ofstream file_5;
 	// This is weirdly necessary to prevent data loss on windows
 	file_1.open(filename1);
 	file_2.open(filename2);
 	file_3.open(filename3);
 	file_4.open(filename4);
+	file_5.open(filename5);
 	file_1.close();
 	file_2.close();
 	file_3.close();
 	file_4.close();
+	file_5.close();
 
 	// Total number of available microsteps for each drive.
 	double xmicrosteptot = 8062992;
@@ -227,248 +239,1021 @@ int main(int argc, char* argv[])
 
 	// Get parameters from input config file
 	map<string, double> varMap = configParser(paramFile);
+	map<string, string> textMap = configStrings(paramFile);
+
+	// "pointsFile" lists arbitrary "xCm yCm" targets to scan in place of
+	// the xOriginCm..nStepsY grid
+	bool pointScan = textMap.count("pointsFile") > 0;
+
+	// "flyScan 1" sweeps each grid row at constant speed and measures on
+	// the way past each point; "flyPointMs" is the time allowed per point
+	// (250 unless set) and so sets the sweep speed
+	bool flyScan = varMap.count("flyScan") && varMap["flyScan"] != 0;
+	if (flyScan && pointScan)
+	{
+		cout << "Fly scans need a grid; scanning the points file point by point" << endl;
+		flyScan = false;
+	}
+	double flyPointMs = varMap.count("flyPointMs") && varMap["flyPointMs"] > 0 ? varMap["flyPointMs"] : 250.0;
+
+	// "refineLevels N" measures the grid as a coarse pass, then quarters
+	// cells whose VMIN readings differ by more than "refineVmin" volts
+	// (0.05 unless set; "refineVavg" adds the same test on VAVG), up to N
+	// times, until "refinePoints" points or "refineMinutes" are used
+	int refineLevels = varMap.count("refineLevels") ? max(0, min(10, (int)varMap["refineLevels"])) : 0;
+	if (refineLevels > 0 && (pointScan || flyScan))
+	{
+		cout << "Adaptive refinement needs a point-by-point grid scan; measuring the plain grid" << endl;
+		refineLevels = 0;
+	}
+
+	// "planFile path" runs a plan saved by an earlier scan (its
+	// _PLAN.txt) in place of compiling one: its points, order, labels
+	// and drive settings replace the grid or points file, which need not
+	// be given, and no mask or tour is applied again
+	bool planned = textMap.count("planFile") > 0;
+	if (planned && (flyScan || refineLevels > 0))
+	{
+		cout << "A saved plan is measured point by point; ignoring flyScan and refineLevels" << endl;
+		flyScan = false;
+		refineLevels = 0;
+	}
+	int refineScale = 1 << refineLevels;
+	double refineVmin = varMap.count("refineVmin") ? varMap["refineVmin"] : 0.05;
+	double refineVavg = varMap.count("refineVavg") ? varMap["refineVavg"] : 0.0;
+	double refineMinutes = varMap.count("refineMinutes") ? varMap["refineMinutes"] : 0.0;
 
 	// Check that configuration file is valid, returns 0 if param names are valid
-	int check = checkVarMap(varMap);
+	int check = pointScan || planned ? 0 : checkVarMap(varMap);
 	if (check != 0)
 	{
 		cout << "Invalid parameters file" << endl;
 		exit(0);
 	}
 
-	// Determine step lengths from input parameters
-	double xsteplengthcm = (varMap["xMaxCm"] - varMap["xOriginCm"]) / ((int)varMap["nStepsX"] - 1);
-	double ysteplengthcm = (varMap["yMaxCm"] - varMap["yOriginCm"]) / ((int)varMap["nStepsY"] - 1);
+	// Scan targets in microsteps, in visiting order. Readings are written
+	// in that order, so each target's label ("column,row" on the grid,
+	// index from 0 in a points file) goes to the _POSITIONS file.
+	vector<StagePoint> targets;
+	vector<string> targetLabels;
+	// Grid scans only: each target's column and row, in steps of
+	// 1/refineScale of the grid spacing from gridOrigin
+	vector<GridPoint> targetCells;
+	StagePoint gridOrigin = {0.0, 0.0};
+	StagePoint latticeStep = {0.0, 0.0};
+	string scanOrderName;
+	if (planned)
+	{
+		scanOrderName = textMap["planFile"];
+	}
+	else if (pointScan)
+	{
+		vector<StagePoint> pointsCm;
+		try
+		{
+			pointsCm = ReadScanPoints(textMap["pointsFile"]);
+		}
+		catch (const exception& e)
+		{
+			cout << e.what() << endl;
+			return 0;
+		}
+		for (size_t p = 0; p < pointsCm.size(); p++)
+		{
+			targets.push_back(StagePoint{pointsCm[p].X * stepspercm, pointsCm[p].Y * stepspercm});
+			targetLabels.push_back(to_string(p));
+		}
+		scanOrderName = "tour";
+	}
+	else
+	{
+		// Determine step lengths from input parameters
+		double xsteplengthcm = (varMap["xMaxCm"] - varMap["xOriginCm"]) / ((int)varMap["nStepsX"] - 1);
+		double ysteplengthcm = (varMap["yMaxCm"] - varMap["yOriginCm"]) / ((int)varMap["nStepsY"] - 1);
 
-	// Make vectors of all x,y values converted from cm to steps
-	vector<double> xvals;
-	for (int i = 0; i < (int)varMap["nStepsX"]; i++)
-    {
-        double xvalcm = varMap["xOriginCm"] + i*xsteplengthcm;
-        double xval = xvalcm * stepspercm;
-        xvals.push_back(xval);
-    }
-	vector<double> yvals;
-	for (int i = 0; i < (int)varMap["nStepsY"]; i++)
-    {
-        double yvalcm = varMap["yOriginCm"] + i*ysteplengthcm;
-        double yval = yvalcm * stepspercm;
-        yvals.push_back(yval);
-    }
+		// Make vectors of all x,y values converted from cm to steps
+		vector<double> xvals;
+		for (int i = 0; i < (int)varMap["nStepsX"]; i++)
+		{
+			double xvalcm = varMap["xOriginCm"] + i*xsteplengthcm;
+			double xval = xvalcm * stepspercm;
+			xvals.push_back(xval);
+		}
+		vector<double> yvals;
+		for (int i = 0; i < (int)varMap["nStepsY"]; i++)
+		{
+			double yvalcm = varMap["yOriginCm"] + i*ysteplengthcm;
+			double yval = yvalcm * stepspercm;
+			yvals.push_back(yval);
+		}
+
+		// Warns if step settings distort scan grid.
+		if (fabs(xsteplengthcm - ysteplengthcm) > 5)
+		{
+			cout << "Warning: Check Aspect Ratio." << endl;
+			cout << "Each step in X is " << xsteplengthcm << "cm" << endl;
+			cout << "Each step in Y is " << ysteplengthcm << "cm" << endl;
+			cout << "It might be desired to adjust x-axis and y-axis parameters to produce similar values" << endl;
+			Sleep(10000);
+		}
+
+		if ((int)varMap["nStepsX"] <= 1 || (int)varMap["nStepsY"] <= 1)
+		{
+			cout << "Must have more than 1 step in both x and y" << endl;
+			return 0;
+		}
+
+		// Order the grid points are visited in. "scanOrder" names a strategy
+		// (serpentine unless set); "scanOrderFile" lists "column row" pairs
+		// instead.
+		scanOrderName = textMap.count("scanOrder") ? textMap["scanOrder"] : "serpentine";
+		if (flyScan && ((textMap.count("scanOrder") && scanOrderName != "rows") || textMap.count("scanOrderFile")))
+		{
+			cout << "Fly scans sweep the rows alternately; ignoring the scan order setting" << endl;
+		}
+		if (flyScan)
+		{
+			scanOrderName = "rows";
+		}
+		vector<GridPoint> scanOrder;
+		if (textMap.count("scanOrderFile") && !flyScan)
+		{
+			scanOrderName = textMap["scanOrderFile"];
+			try
+			{
+				scanOrder = ReadScanOrder(scanOrderName, (int)xvals.size(), (int)yvals.size());
+			}
+			catch (const exception& e)
+			{
+				cout << e.what() << endl;
+				return 0;
+			}
+		}
+		else
+		{
+			// "tour" plans the grid like a points file once the stages are up
+			ScanOrderFn orderFn = scanOrderName == "tour" ? RasterOrder : ScanOrderByName(scanOrderName);
+			if (orderFn == nullptr)
+			{
+				cout << "Unknown scanOrder " << scanOrderName << ", use raster, serpentine, rows, spiral, hilbert or tour" << endl;
+				return 0;
+			}
+			scanOrder = orderFn((int)xvals.size(), (int)yvals.size());
+		}
+		gridOrigin = StagePoint{xvals[0], yvals[0]};
+		latticeStep = StagePoint{xsteplengthcm * stepspercm / refineScale, ysteplengthcm * stepspercm / refineScale};
+		for (const GridPoint& point : scanOrder)
+		{
+			GridPoint cell = {point.Column * refineScale, point.Row * refineScale};
+			targets.push_back(StagePoint{xvals[point.Column], yvals[point.Row]});
+			targetLabels.push_back(to_string(cell.Column) + "," + to_string(cell.Row));
+			targetCells.push_back(cell);
+		}
+	}
+
+	// "maskFile" gives the tile footprint as polygons or a bitmap in cm;
+	// points outside it are dropped. A masked grid is toured unless a
+	// scan order was asked for, since its rows no longer run edge to edge.
+	bool masked = textMap.count("maskFile") > 0;
+	ScanMask mask;
+	if (masked && flyScan)
+	{
+		cout << "Fly scans sweep whole rows; ignoring the scan mask" << endl;
+		masked = false;
+	}
+	if (masked && planned)
+	{
+		cout << "A saved plan keeps its own points; ignoring the scan mask" << endl;
+		masked = false;
+	}
+	if (masked)
+	{
+		try
+		{
+			mask = ScanMask::Load(textMap["maskFile"]);
+		}
+		catch (const exception& e)
+		{
+			cout << e.what() << endl;
+			return 0;
+		}
+		vector<StagePoint> keptTargets;
+		vector<string> keptLabels;
+		vector<GridPoint> keptCells;
+		for (size_t k = 0; k < targets.size(); k++)
+		{
+			if (mask.Contains(targets[k].X / stepspercm, targets[k].Y / stepspercm))
+			{
+				keptTargets.push_back(targets[k]);
+				keptLabels.push_back(targetLabels[k]);
+				if (!targetCells.empty())
+				{
+					keptCells.push_back(targetCells[k]);
+				}
+			}
+		}
+		cout << "Scan mask keeps " << keptTargets.size() << " of " << targets.size() << " points" << endl;
+		if (keptTargets.empty())
+		{
+			cout << "No scan points inside the mask" << endl;
+			return 0;
+		}
+		if (keptTargets.size() < targets.size() && !textMap.count("scanOrder") && !textMap.count("scanOrderFile"))
+		{
+			scanOrderName = "tour";
+		}
+		targets.swap(keptTargets);
+		targetLabels.swap(keptLabels);
+		targetCells.swap(keptCells);
+	}
+	// A saved plan's origin is its first point, known once it is loaded
+	StagePoint scanOrigin = planned ? StagePoint{0.0, 0.0} : targets[0];
+
+	// VMIN and VAVERAGE are measured at every point; "scopeMeasurements"
+	// adds more as a comma-separated list (VMAX,RISETIME,AREA,...), all
+	// read in one query and written to _MEASURE.txt
+	MeasurementSet measurements;
+	measurements.Add("VMIN");
+	measurements.Add("VAVERAGE");
+	if (textMap.count("scopeMeasurements"))
+	{
+		stringstream names(textMap["scopeMeasurements"]);
+		string name;
+		while (getline(names, name, ','))
+		{
+			if (!name.empty() && !measurements.Add(name))
+			{
+				cout << "Unknown scope measurement " << name << endl;
+				return 0;
+			}
+		}
+	}
+	const int vminIndex = measurements.Index("VMIN");
+	const int vavgIndex = measurements.Index("VAVERAGE");
+	string filename9 = outputDir + timeStamp + "_MEASURE.txt";
+	ofstream file_9;
+	if (measurements.Size() > 2)
+	{
+		file_9.open(filename9);
+		file_9 << "POINT";
+		for (size_t i = 0; i < measurements.Size(); i++)
+		{
+			file_9 << "," << measurements.Name(i);
+		}
+		file_9 << endl;
+		file_9.close();
+	}
+	vector<ScopeReading> readings;
+	auto writeMeasurements = [&](const string& label)
+	{
+		if (measurements.Size() > 2)
+		{
+			file_9.open(filename9,ofstream::app);
+			file_9 << label;
+			for (const ScopeReading& reading : readings)
+			{
+				file_9 << "," << reading.Value;
+			}
+			file_9 << endl;
+			file_9.close();
+		}
+	};
+
+	// Move times come from a per-axis model refitted from each scan's
+	// moves and kept between runs ("motionModelFile", motionmodel.txt by
+	// default). It bounds the wait for move-complete replies, plans tours
+	// and gives the ETA; its margin shrinks as the fit improves.
+	string motionFile = textMap.count("motionModelFile") ? textMap["motionModelFile"] : "motionmodel.txt";
+	MotionModel motion;
+	if (motion.Load(motionFile))
+	{
+		cout << "Loaded stage motion model from " << motionFile << endl;
+	}
+	else
+	{
+		cout << "No stage motion model in " << motionFile << ", starting from defaults" << endl;
+	}
+
+	// "moveProfiles 1" programs speed and acceleration with every move:
+	// the axis with further to go runs at the limits ("xMaxSpeed",
+	// "xMaxAccel", "yMaxSpeed", "yMaxAccel" in microsteps/s and /s^2,
+	// the fitted values unless set) and the other is eased to arrive
+	// with it
+	bool moveProfiles = varMap.count("moveProfiles") && varMap["moveProfiles"] != 0;
+	const char* limitKeys[2][2] = {{"xMaxSpeed", "xMaxAccel"}, {"yMaxSpeed", "yMaxAccel"}};
+	for (int axis = 0; axis < 2; axis++)
+	{
+		if (varMap.count(limitKeys[axis][0]) && varMap[limitKeys[axis][0]] > 0)
+		{
+			motion.Limit[axis].Velocity = varMap[limitKeys[axis][0]];
+		}
+		if (varMap.count(limitKeys[axis][1]) && varMap[limitKeys[axis][1]] > 0)
+		{
+			motion.Limit[axis].Accel = varMap[limitKeys[axis][1]];
+		}
+	}
 
-	//////////////////////////////////////////////////////////////////////
-	////////////////// Check validity of parameters /////////////////////
-	// Checks to see if parameters are within physics ranges of the stages
-	double xmin = *min_element(xvals.begin(), xvals.end());
-	double xmax = *max_element(xvals.begin(), xvals.end());
-	double ymin = *min_element(yvals.begin(), yvals.end());
-	double ymax = *max_element(yvals.begin(), yvals.end());
-	if (xmin <= 0 || xmax >= xmicrosteptot || ymin <= 0 || ymax >= ymicrosteptot)
+	// Both stages move at once, so a move lasts as long as its slower
+	// axis; order the targets to keep the total of those low. Tours start
+	// from the scan origin, where the previous scan left the stages.
+	if (scanOrderName == "tour" && !planned)
 	{
+		MoveCostFn moveCost = [&motion](const StagePoint& a, const StagePoint& b)
+		{
+			return motion.MoveSeconds(fabs(b.X - a.X), fabs(b.Y - a.Y));
+		};
+		vector<size_t> identity(targets.size());
+		for (size_t k = 0; k < targets.size(); k++)
+		{
+			identity[k] = k;
+		}
+		vector<size_t> tour = PlanTour(targets, scanOrigin, moveCost);
+		cout << "Planned tour: " << TourCost(targets, tour, scanOrigin, moveCost) << " s of stage travel, "
+			<< TourCost(targets, identity, scanOrigin, moveCost) << " s in listed order" << endl;
+		vector<StagePoint> tourTargets;
+		vector<string> tourLabels;
+		vector<GridPoint> tourCells;
+		for (size_t index : tour)
+		{
+			tourTargets.push_back(targets[index]);
+			tourLabels.push_back(targetLabels[index]);
+			if (!targetCells.empty())
+			{
+				tourCells.push_back(targetCells[index]);
+			}
+		}
+		targets.swap(tourTargets);
+		targetLabels.swap(tourLabels);
+		targetCells.swap(tourCells);
+	}
+	if (!planned)
+	{
+		cout << "Visiting " << targets.size() << " points in " << scanOrderName << " order" << endl;
+	}
+
+	// Compile the scan once: integer targets checked against the drive
+	// lengths, with move predictions, wait bounds and ETA. The run loop
+	// moves by it and retimes the points left when the model refits.
+	ScanPlan plan;
+	try
+	{
+		if (planned)
+		{
+			plan = ScanPlan::Load(textMap["planFile"], (long)xmicrosteptot, (long)ymicrosteptot);
+			cout << "Running the " << plan.Size() << " points of " << textMap["planFile"] << endl;
+			if (moveProfiles != plan.IsProfiled())
+			{
+				cout << "The saved plan " << (plan.IsProfiled() ? "programs" : "does not program")
+					<< " speed and acceleration with its moves; ignoring moveProfiles" << endl;
+				moveProfiles = plan.IsProfiled();
+			}
+		}
+		else
+		{
+			plan = ScanPlan::Compile(targets, targetLabels, scanOrigin, motion, (long)xmicrosteptot, (long)ymicrosteptot, moveProfiles);
+		}
+	}
+	catch (const out_of_range& e)
+	{
+		cout << e.what() << endl;
 		cout << "Settings take the source beyond the end of the drive. Please readjust." << endl;
 		Sleep(10000);
 		return 0;
 	}
+	catch (const runtime_error& e)
+	{
+		cout << e.what() << endl;
+		return 0;
+	}
+	if (plan.Size() == 0)
+	{
+		cout << "The scan plan has no points" << endl;
+		return 0;
+	}
+	if (planned)
+	{
+		scanOrigin = StagePoint{(double)plan[0].X, (double)plan[0].Y};
+	}
+	string filename6 = outputDir + timeStamp + "_PLAN.txt";
+	if (!plan.Save(filename6))
+	{
+		cout << "Warning: unable to save the scan plan to " << filename6 << endl;
+	}
+	cout << "Predicted stage travel " << plan.EtaMs() / 1000 << " s" << endl;
+
+	// Initialize stepper motors and rezero drives. Optional config keys
+	// "zaberAscii 1" selects the ASCII protocol (115200 baud unless
+	// "zaberBaud" says otherwise); the default is binary at 9600.
+	bool zaberAscii = varMap.count("zaberAscii") && varMap["zaberAscii"] != 0;
+	unsigned long zaberBaud = zaberAscii ? 115200 : 9600;
+	if (varMap.count("zaberBaud"))
+	{
+		zaberBaud = (unsigned long)varMap["zaberBaud"];
+	}
+	ZaberPort stages(2);
+	if (!stages.Open("com3", zaberBaud))
+	{
+		cout << "Unable to open the stage serial port " << stages.Name() << endl;
+		return 0;
+	}
+	// "captureSerial 1" records all stage traffic for offline replay
+	// with zreplay
+	if (varMap.count("captureSerial") && varMap["captureSerial"] != 0)
+	{
+		string captureFile = outputDir + timeStamp + "_SERIAL.zcap";
+		if (!stages.StartCapture(captureFile))
+		{
+			cout << "Warning: unable to create serial capture " << captureFile << endl;
+		}
+	}
 
-	// Warns if step settings distort scan grid.
-	if (fabs(xsteplengthcm - ysteplengthcm) > 5)
+	// Serial reads and writes run on their own thread from here on, so
+	// the scope calls below cannot delay them.
+	ZaberIoThread stageIo(stages, zaberAscii);
+	unique_ptr<ZaberLink> zaber;
+	if (zaberAscii)
 	{
-		cout << "Warning: Check Aspect Ratio." << endl;
-		cout << "Each step in X is " << xsteplengthcm << "cm" << endl;
-		cout << "Each step in Y is " << ysteplengthcm << "cm" << endl;
-		cout << "It might be desired to adjust x-axis and y-axis parameters to produce similar values" << endl;
-		Sleep(10000);
+		unique_ptr<ZaberAscii> ascii(new ZaberAscii(stageIo));
+		if (!ascii->Initialize(1500))
+		{
+			cout << "Warning: not every drive enabled reply checksums and move-complete alerts" << endl;
+		}
+		zaber = move(ascii);
+	}
+	else
+	{
+		zaber.reset(new ZaberAsync(stageIo));
+	}
+	XYStage stage(*zaber);
+	vector<future<long>> renumbered = zaber->Broadcast(ZABER_RENUMBER, 0);
+	if (!zaber->AwaitAll(renumbered, 1500))
+	{
+		cout << "Warning: not every drive answered the renumber command" << endl;
+		zaber->CancelAll();
 	}
 
-	if ((int)varMap["nStepsX"] <= 1 || (int)varMap["nStepsY"] <= 1)
-    {
-        cout << "Must have more than 1 step in both x and y" << endl;
-        return 0;
-    }
-    //////////////////////////////////////////////////////////////////////
-
-	// Initialize stepper motors and rezero drives
-	PSERIAL_Initialize();
-	PSERIAL_Open("com3");
-	PSERIAL_Send(0, 2, 0);
-	Sleep(1500);
-
-	// Variables for recording current positions of drives. Used to calibrate
-	// wait times. Takes stage 860ms to go 8062992 steps, use 1000(ms/cm) for margin.
-	double xcurrentpos = 0.0;
-	double ycurrentpos = 0.0;
-	double sleeptime = 0.0;
-
-	// Variables for PSERIAL_Receive command.
-	unsigned char Unit;
-	unsigned char Unit2;
-	unsigned char Command;
-	unsigned char Command2;
-	long Data;
-	long Data2;
+	// Positions are tracked from the move replies; the drives are only
+	// asked every "verifyEvery" points (25 unless set) or after a move
+	// that did not finish where it was sent
+	unsigned int verifyEvery = 25;
+	if (varMap.count("verifyEvery") && varMap["verifyEvery"] >= 0)
+	{
+		verifyEvery = (unsigned int)varMap["verifyEvery"];
+	}
+	PositionTracker position(stage, verifyEvery);
 
 	// Get initial position
-	PSERIAL_Send(1, 60, 64);
-	while (1)
+	while (!position.Verify(replyWaitMs))
 	{
-		if (PSERIAL_Receive (&Unit,&Command,&Data) && Unit == 1 && Command == 60)
-		{
-			xcurrentpos = Data;
-			break;
-		}
+		cout << "No position reply from the drives, asking again" << endl;
 	}
-	Sleep(1500);
-	PSERIAL_Send(2, 60, 64);
-	while (1)
+	cout << "The position of the X stepper is " << position.X() << "." << endl;
+	cout << "The position of the Y stepper is " << position.Y() << "." << endl;
+
+	// Scan, visiting the targets in order
+	cout << "Now starting the scan..." << endl;
+	size_t measuredPoints = plan.Size();
+	// Each arrived move's time per axis goes to the motion model at once,
+	// which refits every few samples, so move waits, profiles and the ETA
+	// tighten as the scan runs. Eased axes ran below the limits and are
+	// left out.
+	auto recordMove = [&motion](const MoveResult& move, long dx, long dy, const MoveProfile& profile)
 	{
-		if (PSERIAL_Receive (&Unit2,&Command2,&Data2) && Unit2 == 2 && Command2 == 60)
+		if (!move.Arrived)
+		{
+			return;
+		}
+		if (!profile.Eased[MOTION_X])
+		{
+			motion.Record(MOTION_X, (double)dx, move.XSeconds);
+		}
+		if (!profile.Eased[MOTION_Y])
 		{
-			ycurrentpos = Data2;
-			break;
+			motion.Record(MOTION_Y, (double)dy, move.YSeconds);
 		}
+	};
+
+	// One scope session for the whole scan; a call that fails clears
+	// the scope or reopens the session and is tried again. Acquisitions
+	// are waited for by service request, for up to "scopeAcquireMs"
+	// (2000000 unless set)
+	ScopeSession scope("gpib1,7");
+	unsigned long scopeAcquireMs = varMap.count("scopeAcquireMs") ? (unsigned long)varMap["scopeAcquireMs"] : 2000000;
+	if (!scope.Open())
+	{
+		cout << "Warning: unable to open the scope, will retry at the first reading" << endl;
 	}
-	cout << "The position of the X stepper is " << xcurrentpos << "." << endl;
-	cout << "The position of the Y stepper is " << ycurrentpos << "." << endl;
 
-	// Scan, looping over all x,y steps
-	cout << "Now starting the scan..." << endl;
-	for (int i = 0; i < xvals.size(); i++)
+	// Scope setup for the LED; grid and point scans average 1500
+	// acquisitions per reading.  Only settings that differ from the
+	// last applied are sent, so applying it at every point is free.
+	ScopeState scopeSetup;
+	scopeSetup.Channel = 1;
+	scopeSetup.TimebaseScale = 20E-9;
+	scopeSetup.TimebasePosition = 130E-9; // LED
+	scopeSetup.ChannelScale = 500E-3;     // New LED 375 nm
+	scopeSetup.ChannelOffset = -1300E-3;
+	scopeSetup.Averaging = !flyScan && plan.Size() > 1;
+	scopeSetup.AverageCount = 1500;
+	scopeSetup.SendValid = true;
+
+	// "saveWaveforms 1" also reads each reading's channel record as
+	// 16-bit words and appends it to _WAVEFORMS.bin: a 4-byte word count
+	// (0 if the read failed) then the words, in _POSITIONS.txt order.
+	// The preamble scale goes to the metadata.
+	bool saveWaveforms = varMap.count("saveWaveforms") && varMap["saveWaveforms"] != 0;
+	scopeSetup.Waveform = saveWaveforms;
+	string filename10 = outputDir + timeStamp + "_WAVEFORMS.bin";
+	ofstream file_10;
+	vector<short> waveform;
+	WaveformScale waveformScale = {};
+	auto captureWaveform = [&]()
 	{
-		for (int j = 0; j < yvals.size(); j++)
+		if (!saveWaveforms)
 		{
-			// Get current position
-			PSERIAL_Send(1, 60, 64);
-			while (1)
-			{
-				if (PSERIAL_Receive (&Unit,&Command,&Data) && Unit == 1 && Command == 60)
-				{
-					xcurrentpos = Data;
-					break;
-				}
-			}
-			PSERIAL_Send(2, 60, 64);
-			while (1)
+			return;
+		}
+		if (!scope.ReadWaveform(waveform, waveformScale))
+		{
+			waveform.clear();
+		}
+		uint32_t count = (uint32_t)waveform.size();
+		file_10.open(filename10,ofstream::app | ofstream::binary);
+		file_10.write((const char*)&count, sizeof(count));
+		file_10.write((const char*)waveform.data(), count * sizeof(short));
+		file_10.close();
+	};
+	if (flyScan)
+	{
+		// The plan holds the grid row by row, alternating direction. X
+		// runs up to the sweep speed before a row's first point and on
+		// past its last, then the scope is triggered as each point goes
+		// by; the drives' speed is back to normal between rows.
+		FlyScanner fly(stage, motion);
+		if (!fly.Begin(replyWaitMs))
+		{
+			cout << "Unable to read the X drive's speed and acceleration for the fly scan" << endl;
+			stageIo.Stop();
+			stages.Close();
+			return 0;
+		}
+		// Points are a grid X step apart along each row (refinement is
+		// off, so the lattice step is the grid step)
+		size_t rowLength = (size_t)varMap["nStepsX"];
+		double spacing = fabs(latticeStep.X);
+		double flyVelocity = min(spacing * 1000.0 / flyPointMs, motion.Axis[MOTION_X].Velocity);
+		if (!(flyVelocity > 0))
+		{
+			cout << "Fly scans need distinct X points and a fitted X velocity" << endl;
+			stageIo.Stop();
+			stages.Close();
+			return 0;
+		}
+		long runUp = fly.RunUp(flyVelocity);
+		cout << "Sweeping rows at " << flyVelocity << " microsteps/s, " << runUp << " microsteps of run-up" << endl;
+
+		// Each point is a single unaveraged acquisition
+		scope.Apply(scopeSetup);
+
+		string filename7 = outputDir + timeStamp + "_FLY.txt";
+		ofstream file_7(filename7);
+		file_7 << "POINT,SECONDS,XSTEPS,YSTEPS" << endl;
+		auto scanStart = chrono::steady_clock::now();
+		long maxErrorSteps = 0;
+		for (size_t k0 = 0; k0 < plan.Size(); k0 += rowLength)
+		{
+			size_t k1 = min(k0 + rowLength, plan.Size());
+			long y = plan[k0].Y;
+			vector<long> triggers;
+			for (size_t k = k0; k < k1; k++)
 			{
-				if (PSERIAL_Receive (&Unit2,&Command2,&Data2) && Unit2 == 2 && Command2 == 60)
-				{
-					ycurrentpos = Data2;
-					break;
-				}
+				triggers.push_back(plan[k].X);
 			}
+			long direction = triggers.back() >= triggers.front() ? 1 : -1;
+			long from = max(0L, min((long)xmicrosteptot, triggers.front() - direction * runUp));
+			long to = max(0L, min((long)xmicrosteptot, triggers.back() + direction * runUp));
 
-			// Determine sleeptime from largest travel in x or y for next step
-			if(fabs(xcurrentpos - xvals[i]) > fabs(ycurrentpos - yvals[j]))
+			// Full-speed move to the start of the row
+			if (position.NeedsVerify() && !position.Verify(replyWaitMs))
 			{
-				sleeptime = 100*1000*(fabs(xcurrentpos - xvals[i])/xmicrosteptot); //(length of drive in cm)*(ms/cm)*(fraction of drive)
+				cout << "Warning: no position reply, moving from the tracked position" << endl;
 			}
-			else
+			long dx = labs(position.X() - from);
+			long dy = labs(position.Y() - y);
+			cout << endl << "Row " << k0 / rowLength + 1 << " of " << (plan.Size() + rowLength - 1) / rowLength << endl;
+			MoveResult move = stage.MoveTo(from, y, motion.TimeoutMs((double)dx, (double)dy));
+			position.Moved(from, y, move);
+			if (!move.Arrived)
 			{
-				sleeptime = 50*1000*(fabs(ycurrentpos - yvals[j])/ymicrosteptot); //(length of drive in cm)*(ms/cm)*(fraction of drive)
+				cout << "Warning: no move-complete reply at the start of the row, sweeping anyway" << endl;
 			}
+			recordMove(move, dx, dy, MoveProfile{{0.0, 0.0}, {0.0, 0.0}, {false, false}});
 
-			// Move to next scan position
-			cout << endl << "Moving to column " << i << ", row " << j << endl;
-			PSERIAL_Send(1, 20, xvals[i]);
-			PSERIAL_Send(2, 20, yvals[j]);
-			Sleep(sleeptime);
-
-			//Take scope readings
-			cout << "Taking scope readings" << endl;
-			oscillo = iopen("gpib1,7");
-			double vmin1 = 10.0;
-			double vavg1 = 10.0;
-			clock_t t;
-			itimeout(oscillo, 2000000);
-
-			// FOR SOURCE TEST, CHECK EVERY TIME
-			WriteIO(":CDISPLAY");
-			WriteIO(":VIEW CHANNEL1");
-			WriteIO(":TIMEBASE:SCALE 20E-9");
-			WriteIO(":TIMEBASE:POSITION 130E-9"); // LED
-			// New LED 375 nm
-			WriteIO(":CHANNEL1:SCALE 500E-3");
-			WriteIO(":CHANNEL1:OFFSET -1300E-3");
-
-			// Get clock for time output
-			t = clock();
-
-			// Start scope
-			WriteIO(":RUN");
-			WriteIO(":MEASURE:SENDVALID ON");
-
-			// Only needed if using 1 step, not used currently
-			// --- it's necessary to delay between unaveraged readouts so the scope doesn't choke and give duplicates
-			// --- 100 (msec) is safe for source on panel, lower may also be possible
-			// --- 200 is needed for off panel
-			// --- 5000 is good for cosmics...
-			//int sleep = 100;
-
-			if ((int)varMap["nStepsX"] > 1 || (int)varMap["nStepsY"] > 1)
+			// Each reading is stamped from the scan start and with where X
+			// is estimated to have been when the scope was triggered
+			vector<FlySample> samples;
+			vector<double> stamps;
+			MoveResult sweep = fly.Sweep(y, from, to, triggers, flyVelocity, [&](size_t i)
 			{
-				//oscillo = iopen("gpib1,7");
-				WriteIO(":ACQUIRE:AVERAGE:COUNT 1500");
-				WriteIO(":ACQUIRE:AVERAGE ON");
-
-				// --- Measure the VMin for Channel 1
-				//oscillo = iopen("gpib1,7");
-				WriteIO(":MEASURE:SOURCE CHANNEL1");
-				WriteIO(":MEASURE:VMIN");
-				WriteIO(":MEASURE:VMIN?");
-				ReadDouble(&vmin1);
-				cout << "VMin 1 "<< vmin1 << endl;
-				iclose(oscillo);
-
-				// --- Measure the VAvg for Channel 1
-				oscillo = iopen("gpib1,7");
-				WriteIO(":MEASURE:SOURCE CHANNEL1");
-				WriteIO(":MEASURE:VAVERAGE");
-				WriteIO(":MEASURE:VAVERAGE?");
-				ReadDouble(&vavg1);
-				cout << "VAvg 1 " << vavg1 << endl;
-				iclose(oscillo);
-
+				stamps.push_back(chrono::duration<double>(chrono::steady_clock::now() - scanStart).count());
+				double vmin1 = 10.0;
+				double vavg1 = 10.0;
+				scope.StartAcquisition();
+				scope.WaitAcquisition(scopeAcquireMs);
+				if (scope.Measure(measurements, readings))
+				{
+					vmin1 = readings[vminIndex].Value;
+					vavg1 = readings[vavgIndex].Value;
+				}
+				writeMeasurements(plan[k0 + i].Label);
+				captureWaveform();
 				file_2.open(filename2,ofstream::app);
 				file_2 << vmin1 << endl;
 				file_2.close();
 				file_3.open(filename3,ofstream::app);
 				file_3 << vavg1 << endl;
 				file_3.close();
+				file_4.open(filename4,ofstream::app);
+				file_4 << chrono::duration<double>(chrono::steady_clock::now() - scanStart).count() - stamps.back() << endl;
+				file_4.close();
+				file_5.open(filename5,ofstream::app);
+				file_5 << plan[k0 + i].Label << endl;
+				file_5.close();
+			}, samples);
+			position.Moved(to, y, sweep);
+			if (!sweep.Arrived)
+			{
+				cout << "Warning: no move-complete reply at the end of the row" << endl;
+			}
+			for (const FlySample& sample : samples)
+			{
+				file_7 << plan[k0 + sample.Index].Label << "," << stamps[sample.Index] << ","
+					<< sample.X << "," << y << endl;
+				maxErrorSteps = max(maxErrorSteps, labs(sample.X - triggers[sample.Index]));
 			}
+			cout << samples.size() << " points measured in " << sweep.Seconds << " seconds" << endl;
+		}
+		file_7.close();
+		cout << "Fly scan took " << fly.Fixes() << " position fixes; readings were at most "
+			<< maxErrorSteps << " microsteps from their points" << endl;
+	}
+	else
+	{
+		// Points are measured once settled, not after a fixed wait. With
+		// "settleReads" N both drives must read within "settleSteps"
+		// microsteps (10 unless set) of the target N times running, and
+		// with "settleScopeVolts" set the scope's VAVG must hold within
+		// that many volts over fresh acquisitions. Open-loop drives report
+		// the commanded position once the move reply is in, so neither
+		// test is on unless asked for; without them each point waits the
+		// motion model's fitted settle time. "settleTimeoutMs" (500)
+		// bounds the wait. Settle times go to _SETTLE.txt.
+		unsigned int settleReads = varMap.count("settleReads") && varMap["settleReads"] >= 0 ? (unsigned int)varMap["settleReads"] : 0;
+		long settleSteps = varMap.count("settleSteps") ? (long)varMap["settleSteps"] : 10;
+		unsigned long settleTimeoutMs = varMap.count("settleTimeoutMs") ? (unsigned long)varMap["settleTimeoutMs"] : 500;
+		double settleScopeVolts = varMap.count("settleScopeVolts") ? varMap["settleScopeVolts"] : 0.0;
+		SettleGate settleGate(position, motion, settleReads, settleSteps, settleTimeoutMs);
+		if (settleScopeVolts > 0)
+		{
+			// Each probe read is its own unaveraged acquisition; the stopped
+			// scope would otherwise give back the same value every time.
+			// Averaging goes back on when the point is measured.
+			ScopeState probeSetup = scopeSetup;
+			probeSetup.Averaging = false;
+			settleGate.SetProbe([&scope, probeSetup, settleTimeoutMs](double* volts)
+			{
+				return scope.Apply(probeSetup) && scope.StartAcquisition()
+					&& scope.WaitAcquisition(settleTimeoutMs) && scope.Query(":MEASURE:VAVERAGE?", volts);
+			}, settleScopeVolts);
+		}
+		string filename8 = outputDir + timeStamp + "_SETTLE.txt";
+		ofstream file_8(filename8);
+		file_8.close();
+
+		// Moves to and measures each point of a compiled plan in turn:
+		// the whole scan, or the coarse grid and each refinement pass.
+		// The points left are retimed whenever the model refits, so move
+		// waits and the ETA tighten as the scan runs.
+		const bool averaged = scopeSetup.Averaging;
+		auto measurePlan = [&](ScanPlan& batch, vector<double>& vmins, vector<double>& vavgs)
+		{
+			long long dwellTotalMs = 0; // time spent at points other than moving
+			unsigned long planFits = motion.Fits();
+			for (size_t k = 0; k < batch.Size(); k++)
+			{
+				const PlannedPoint& target = batch[k];
+				auto pointStart = chrono::steady_clock::now();
+
+				// Confirm the tracked position when it is due or in doubt
+				if (position.NeedsVerify() && !position.Verify(replyWaitMs))
+				{
+					cout << "Warning: no position reply, moving from the tracked position" << endl;
+				}
+				long dx = labs(position.X() - target.X);
+				long dy = labs(position.Y() - target.Y);
+
+				// Move to next scan position, waiting no longer than the plan
+				// allows if the drives never report arrival
+				cout << endl << "Moving to point " << target.Label << endl;
+				MoveResult move = stage.MoveTo(target.X, target.Y, target.TimeoutMs, &target.Profile);
+				recordMove(move, dx, dy, target.Profile);
+				position.Moved(target.X, target.Y, move);
+				if (move.Arrived)
+				{
+					cout << "Arrived after " << move.Seconds << " seconds (predicted " << target.PredictedMs << " ms)" << endl;
+				}
+				else
+				{
+					cout << "Warning: no move-complete reply, continuing after " << move.Seconds << " seconds" << endl;
+				}
+
+				// Measure once the stage is still, or after the settle
+				// timeout at worst
+				SettleResult settle = settleGate.Wait(target.X, target.Y);
+				if (settle.Settled)
+				{
+					cout << "Settled after " << settle.Seconds << " seconds" << endl;
+				}
+				else
+				{
+					cout << "Warning: not settled after " << settle.Seconds << " seconds, measuring anyway" << endl;
+				}
+
+				//Take scope readings
+				cout << "Taking scope readings" << endl;
+				double vmin1 = 10.0;
+				double vavg1 = 10.0;
+				clock_t t;
 
-			WriteIO(":STOP");
-			t = clock() - t;
+				// FOR SOURCE TEST, CHECK EVERY TIME; nothing is sent
+				// unless the setup has changed or the scope was lost
+				scope.Apply(scopeSetup);
 
-			// Process data for time output file
-			cout << "It took me " << t << " clicks(" << (float)t/CLOCKS_PER_SEC << " seconds)" << endl;
-			file_4.open(filename4,ofstream::app);
-			file_4 << (float)t/CLOCKS_PER_SEC << endl;
-			file_4.close();
+				// Get clock for time output
+				t = clock();
 
-			cout << "Data Collected" << endl;
-			Sleep(500);
+				// Only needed if using 1 step, not used currently
+				// --- it's necessary to delay between unaveraged readouts so the scope doesn't choke and give duplicates
+				// --- 100 (msec) is safe for source on panel, lower may also be possible
+				// --- 200 is needed for off panel
+				// --- 5000 is good for cosmics...
+				//int sleep = 100;
+
+				if (averaged)
+				{
+					// Start averaging, then get on with what does not need
+					// the scope while it runs: the logs, and the position
+					// check the next move would otherwise wait for
+					scope.StartAcquisition();
+					file_8.open(filename8,ofstream::app);
+					file_8 << settle.Seconds << endl;
+					file_8.close();
+					if (position.NeedsVerify() && !position.Verify(replyWaitMs))
+					{
+						cout << "Warning: no position reply while the scope averaged" << endl;
+					}
+					if (!scope.WaitAcquisition(scopeAcquireMs))
+					{
+						cout << "Warning: measuring an incomplete acquisition" << endl;
+					}
+
+					// --- Measure VMin, VAvg and any others for Channel 1
+					// in one query
+					if (scope.Measure(measurements, readings))
+					{
+						vmin1 = readings[vminIndex].Value;
+						vavg1 = readings[vavgIndex].Value;
+					}
+					for (size_t i = 0; i < measurements.Size(); i++)
+					{
+						cout << measurements.Name(i) << " 1 " << readings[i].Value
+							<< (readings[i].Valid ? "" : " (not valid)") << endl;
+					}
+					writeMeasurements(target.Label);
+					captureWaveform();
+
+					file_2.open(filename2,ofstream::app);
+					file_2 << vmin1 << endl;
+					file_2.close();
+					file_3.open(filename3,ofstream::app);
+					file_3 << vavg1 << endl;
+					file_3.close();
+				}
+				else
+				{
+					file_8.open(filename8,ofstream::app);
+					file_8 << settle.Seconds << endl;
+					file_8.close();
+					scope.Write(":RUN");
+					scope.Write(":STOP");
+				}
+				t = clock() - t;
+
+				// Process data for time output file
+				cout << "It took me " << t << " clicks(" << (float)t/CLOCKS_PER_SEC << " seconds)" << endl;
+				file_4.open(filename4,ofstream::app);
+				file_4 << (float)t/CLOCKS_PER_SEC << endl;
+				file_4.close();
+				file_5.open(filename5,ofstream::app);
+				file_5 << target.Label << endl;
+				file_5.close();
+
+				vmins.push_back(vmin1);
+				vavgs.push_back(vavg1);
+				cout << "Data Collected" << endl;
+
+				// Remaining time: planned moves plus the average time per point
+				// spent measuring so far
+				auto pointMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - pointStart).count();
+				dwellTotalMs += pointMs - (long long)(move.Seconds * 1000);
+				long long remainingMs = (long long)(batch.Size() - k - 1) * dwellTotalMs / (long long)(k + 1);
+				if (planFits != motion.Fits())
+				{
+					batch.Retime(k + 1, motion);
+					planFits = motion.Fits();
+				}
+				if (k + 1 < batch.Size())
+				{
+					remainingMs += (long long)batch[k + 1].RemainingMs;
+				}
+				cout << "Point " << k + 1 << " of " << batch.Size() << ", about " << remainingMs / 60000 << " min "
+					<< remainingMs / 1000 % 60 << " s left" << endl;
+			}
+		};
+		auto scanStart = chrono::steady_clock::now();
+		vector<double> vmins, vavgs;
+		measurePlan(plan, vmins, vavgs);
+		measuredPoints = vmins.size();
+
+		// Refinement passes: each splits the cells that differ most,
+		// tours the new points from wherever the stages are and measures
+		// them the same way
+		if (refineLevels > 0)
+		{
+			int columns = (int)varMap["nStepsX"];
+			int rows = (int)varMap["nStepsY"];
+			size_t refinePoints = (size_t)((columns - 1) * refineScale + 1) * (size_t)((rows - 1) * refineScale + 1);
+			if (varMap.count("refinePoints") && varMap["refinePoints"] > 0)
+			{
+				refinePoints = (size_t)varMap["refinePoints"];
+			}
+			QuadRefiner refiner(columns, rows, refineLevels, refineVmin, refineVavg);
+			for (size_t k = 0; k < plan.Size(); k++)
+			{
+				refiner.Record(targetCells[k], vmins[k], vavgs[k]);
+			}
+			MoveCostFn moveCost = [&motion](const StagePoint& a, const StagePoint& b)
+			{
+				return motion.MoveSeconds(fabs(b.X - a.X), fabs(b.Y - a.Y));
+			};
+			for (int pass = 1; ; pass++)
+			{
+				double minutes = chrono::duration<double>(chrono::steady_clock::now() - scanStart).count() / 60.0;
+				if (refineMinutes > 0 && minutes >= refineMinutes)
+				{
+					cout << "Refinement stopped after " << minutes << " minutes" << endl;
+					break;
+				}
+				size_t room = refinePoints > refiner.Measured() ? refinePoints - refiner.Measured() : 0;
+				vector<GridPoint> split = refiner.Refine(room);
+				if (split.empty())
+				{
+					break;
+				}
+				// Points outside the mask stay unmeasured, so cells that
+				// reach past the footprint stop splitting there
+				vector<GridPoint> cells;
+				vector<StagePoint> points;
+				for (const GridPoint& cell : split)
+				{
+					StagePoint point = {gridOrigin.X + cell.Column * latticeStep.X, gridOrigin.Y + cell.Row * latticeStep.Y};
+					if (!masked || mask.Contains(point.X / stepspercm, point.Y / stepspercm))
+					{
+						cells.push_back(cell);
+						points.push_back(point);
+					}
+				}
+				if (cells.empty())
+				{
+					continue;
+				}
+				StagePoint here = {(double)position.X(), (double)position.Y()};
+				vector<StagePoint> passTargets;
+				vector<string> passLabels;
+				vector<GridPoint> passCells;
+				for (size_t index : PlanTour(points, here, moveCost))
+				{
+					passTargets.push_back(points[index]);
+					passLabels.push_back(to_string(cells[index].Column) + "," + to_string(cells[index].Row));
+					passCells.push_back(cells[index]);
+				}
+				ScanPlan batch = ScanPlan::Compile(passTargets, passLabels, here, motion, (long)xmicrosteptot, (long)ymicrosteptot, moveProfiles);
+				cout << endl << "Refinement pass " << pass << ": " << batch.Size() << " points, about "
+					<< batch.EtaMs() / 1000 << " s of stage travel" << endl;
+				vector<double> passVmins, passVavgs;
+				measurePlan(batch, passVmins, passVavgs);
+				for (size_t k = 0; k < passCells.size(); k++)
+				{
+					refiner.Record(passCells[k], passVmins[k], passVavgs[k]);
+				}
+			}
+			measuredPoints = refiner.Measured();
+			cout << "Adaptive scan measured " << measuredPoints << " of " << (columns - 1) * refineScale + 1
+				<< " x " << (rows - 1) * refineScale + 1 << " points" << endl;
 		}
 	}
 
+	scope.Close();
+	cout << "Scope session reopened " << scope.Reconnects() << " times, " << scope.SettingsSent() << " settings sent" << endl;
+	cout << "Positions verified " << position.Verifications() << " times, "
+		<< position.Mismatches() << " differed from the tracked position" << endl;
+
+	// Final fit of this scan's moves, kept for the next run
+	motion.Fit();
+	if (!motion.Save(motionFile))
+	{
+		cout << "Warning: unable to save the stage motion model to " << motionFile << endl;
+	}
+
 	// Write scan parameters to metadata file
 	file_1.open(filename1,ofstream::app);
 	file_1 << "TILENAME," << tileName << endl;
-	file_1 << "XORIGINCM," <<varMap["xOriginCm"] << endl;
-	file_1 << "XMAXCM," << varMap["xMaxCm"] << endl;
-	file_1 << "XSTEPS," << (int)varMap["nStepsX"] << endl;
-	file_1 << "YORIGINCM," << varMap["yOriginCm"] << endl;
-	file_1 << "YMAXCM," << varMap["yMaxCm"] << endl;
-	file_1 << "YSTEPS," << (int)varMap["nStepsY"] << endl;
+	if (planned)
+	{
+		file_1 << "PLANFILE," << textMap["planFile"] << endl;
+		file_1 << "NPOINTS," << plan.Size() << endl;
+	}
+	else if (pointScan)
+	{
+		file_1 << "POINTSFILE," << textMap["pointsFile"] << endl;
+		file_1 << "NPOINTS," << plan.Size() << endl;
+	}
+	else
+	{
+		file_1 << "XORIGINCM," <<varMap["xOriginCm"] << endl;
+		file_1 << "XMAXCM," << varMap["xMaxCm"] << endl;
+		file_1 << "XSTEPS," << (int)varMap["nStepsX"] << endl;
+		file_1 << "YORIGINCM," << varMap["yOriginCm"] << endl;
+		file_1 << "YMAXCM," << varMap["yMaxCm"] << endl;
+		file_1 << "YSTEPS," << (int)varMap["nStepsY"] << endl;
+		if (masked || refineLevels > 0)
+		{
+			file_1 << "NPOINTS," << measuredPoints << endl;
+		}
+	}
+	file_1 << "SCANORDER," << scanOrderName << endl;
+	if (masked)
+	{
+		file_1 << "MASKFILE," << textMap["maskFile"] << endl;
+	}
+	if (flyScan)
+	{
+		file_1 << "FLYPOINTMS," << flyPointMs << endl;
+	}
+	file_1 << "MOVEPROFILES," << (moveProfiles ? 1 : 0) << endl;
+	if (refineLevels > 0)
+	{
+		file_1 << "REFINELEVELS," << refineLevels << endl;
+		file_1 << "REFINEVMIN," << refineVmin << endl;
+		file_1 << "REFINEVAVG," << refineVavg << endl;
+	}
+	if (saveWaveforms)
+	{
+		file_1 << "WAVEFORMPOINTS," << waveformScale.Points << endl;
+		file_1 << "WAVEFORMXINCREMENT," << waveformScale.XIncrement << endl;
+		file_1 << "WAVEFORMXORIGIN," << waveformScale.XOrigin << endl;
+		file_1 << "WAVEFORMXREFERENCE," << waveformScale.XReference << endl;
+		file_1 << "WAVEFORMYINCREMENT," << waveformScale.YIncrement << endl;
+		file_1 << "WAVEFORMYORIGIN," << waveformScale.YOrigin << endl;
+		file_1 << "WAVEFORMYREFERENCE," << waveformScale.YReference << endl;
+	}
 
 	// Close file and return to scan origin
 	file_1.close();
 	file_2.close();
 	file_3.close();
 	file_4.close();
+	file_5.close();
 	cout << "Returning to scan origin position" << endl;
-	PSERIAL_Send(1, 20, xvals[0]);
-	PSERIAL_Send(2, 20, yvals[0]);
+	if (moveProfiles)
+	{
+		// Leave the drives at the limits rather than eased, for whatever
+		// runs them next
+		MoveProfile fastest = MoveProfile{{0.0, 0.0}, {0.0, 0.0}, {false, false}};
+		for (int axis = 0; axis < 2; axis++)
+		{
+			fastest.Velocity[axis] = motion.Fastest(axis).Velocity;
+			fastest.Accel[axis] = motion.Fastest(axis).Accel;
+		}
+		stage.MoveTo(lround(scanOrigin.X), lround(scanOrigin.Y), motion.TimeoutMs(xmicrosteptot, ymicrosteptot), &fastest);
+	}
+	else
+	{
+		zaber->RequestMany({{1, ZABER_MOVEABSOLUTE, lround(scanOrigin.X)}, {2, ZABER_MOVEABSOLUTE, lround(scanOrigin.Y)}});
+	}
+	stageIo.Stop();
 
-	PSERIAL_Close();
+	stages.Close();
 
 	progEnd = clock();
 	double timeElapsed = double(progEnd - progStart) / double(CLOCKS_PER_SEC);
@@ -0,0 +1,330 @@
+/*------------------------------------------------------------------------
+ Module:        MOTIONMODEL.CPP
+ Project:       StepperMotor
+ Description:   Per-axis move time model fitted online from measured
+                move-complete times.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "motionmodel.h"
+
+using namespace std;
+
+#define WINDOW          200  // most recent samples used per fit
+#define REFIT_EVERY     10   // samples between fits
+#define MIN_SAMPLES     20   // before the fit is trusted for margins
+#define DEFAULT_MARGIN  1.0  // seconds, while the fit is untrusted
+#define MIN_MARGIN      0.02 // seconds, floor under the fitted margin
+#define MARGIN_SIGMAS   4.0
+#define FIT_ITERATIONS  30
+
+MotionModel::MotionModel()
+	: FitCount(0)
+{
+	// Stage covers 8062992 steps in about 860 ms
+	for (int axis = 0; axis < 2; axis++)
+	{
+		Axis[axis].Accel = 1.0e8;
+		Axis[axis].Velocity = 9.4e6;
+		Axis[axis].Settle = 0.05;
+		Limit[axis].Accel = 0.0;
+		Limit[axis].Velocity = 0.0;
+		Limit[axis].Settle = 0.0;
+		Residual[axis] = 0.0;
+		SampleCount[axis] = 0;
+		SinceFit[axis] = 0;
+	}
+}
+
+double MotionModel::AxisSeconds(const AxisMotion& axis, double distance)
+{
+	distance = fabs(distance);
+	if (distance * axis.Accel < axis.Velocity * axis.Velocity)
+	{
+		// Never reaches cruise speed: accelerate half way, then brake
+		return 2.0 * sqrt(distance / axis.Accel) + axis.Settle;
+	}
+	return distance / axis.Velocity + axis.Velocity / axis.Accel + axis.Settle;
+}
+
+double MotionModel::MoveSeconds(double dx, double dy) const
+{
+	return max(AxisSeconds(Axis[MOTION_X], dx), AxisSeconds(Axis[MOTION_Y], dy));
+}
+
+double MotionModel::MarginSeconds() const
+{
+	if (min(SampleCount[MOTION_X], SampleCount[MOTION_Y]) < MIN_SAMPLES)
+	{
+		return DEFAULT_MARGIN;
+	}
+	return max(MIN_MARGIN, MARGIN_SIGMAS * max(Residual[MOTION_X], Residual[MOTION_Y]));
+}
+
+unsigned long MotionModel::TimeoutMs(double dx, double dy) const
+{
+	return (unsigned long)ceil(1000.0 * (MoveSeconds(dx, dy) + MarginSeconds()));
+}
+
+AxisMotion MotionModel::Fastest(int axis) const
+{
+	AxisMotion fastest = Axis[axis];
+	if (Limit[axis].Velocity > 0)
+	{
+		fastest.Velocity = Limit[axis].Velocity;
+	}
+	if (Limit[axis].Accel > 0)
+	{
+		fastest.Accel = Limit[axis].Accel;
+	}
+	return fastest;
+}
+
+MoveProfile MotionModel::Profile(double dx, double dy) const
+{
+	MoveProfile profile;
+	double distance[2] = {fabs(dx), fabs(dy)};
+	double seconds[2];
+	AxisMotion fastest[2];
+	for (int axis = 0; axis < 2; axis++)
+	{
+		fastest[axis] = Fastest(axis);
+		seconds[axis] = AxisSeconds(fastest[axis], distance[axis]) - fastest[axis].Settle;
+	}
+	double slowest = max(seconds[0], seconds[1]);
+	for (int axis = 0; axis < 2; axis++)
+	{
+		double stretch = seconds[axis] > 0 ? slowest / seconds[axis] : 1.0;
+		profile.Velocity[axis] = fastest[axis].Velocity / stretch;
+		profile.Accel[axis] = fastest[axis].Accel / (stretch * stretch);
+		profile.Eased[axis] = stretch > 1.0;
+		if (distance[axis] == 0)
+		{
+			// Not moving, so whatever the drive has will do
+			profile.Velocity[axis] = profile.Accel[axis] = 0.0;
+			profile.Eased[axis] = false;
+		}
+	}
+	return profile;
+}
+
+void MotionModel::Record(int axis, double distance, double seconds)
+{
+	Samples[axis].push_back(Sample{fabs(distance), seconds});
+	if (Samples[axis].size() > WINDOW)
+	{
+		Samples[axis].pop_front();
+	}
+	if (++SinceFit[axis] >= REFIT_EVERY)
+	{
+		FitAxis(axis);
+	}
+}
+
+void MotionModel::Fit()
+{
+	FitAxis(MOTION_X);
+	FitAxis(MOTION_Y);
+}
+
+// Solves the 3x3 system a * x = b by Gaussian elimination with partial
+// pivoting.  Returns false if a is singular.
+static bool Solve3(double a[3][3], double b[3], double x[3])
+{
+	for (int col = 0; col < 3; col++)
+	{
+		int pivot = col;
+		for (int row = col + 1; row < 3; row++)
+		{
+			if (fabs(a[row][col]) > fabs(a[pivot][col]))
+			{
+				pivot = row;
+			}
+		}
+		if (fabs(a[pivot][col]) < 1e-300)
+		{
+			return false;
+		}
+		swap(a[col], a[pivot]);
+		swap(b[col], b[pivot]);
+		for (int row = col + 1; row < 3; row++)
+		{
+			double f = a[row][col] / a[col][col];
+			for (int k = col; k < 3; k++)
+			{
+				a[row][k] -= f * a[col][k];
+			}
+			b[row] -= f * b[col];
+		}
+	}
+	for (int row = 2; row >= 0; row--)
+	{
+		double sum = b[row];
+		for (int k = row + 1; k < 3; k++)
+		{
+			sum -= a[row][k] * x[k];
+		}
+		x[row] = sum / a[row][row];
+	}
+	return true;
+}
+
+// Levenberg-Marquardt on (log accel, log velocity, settle), starting
+// from the current parameters.  Moves that never reach cruise speed say
+// nothing about velocity, so the damping keeps unobserved parameters
+// near their previous values.
+void MotionModel::FitAxis(int axis)
+{
+	const deque<Sample>& samples = Samples[axis];
+	SinceFit[axis] = 0;
+	FitCount++;
+	if (samples.size() < 3)
+	{
+		return;
+	}
+
+	auto model = [](const double p[3], double distance)
+	{
+		AxisMotion m = {exp(p[0]), exp(p[1]), p[2]};
+		return AxisSeconds(m, distance);
+	};
+	auto cost = [&](const double p[3])
+	{
+		double sum = 0.0;
+		for (const Sample& s : samples)
+		{
+			double r = model(p, s.Distance) - s.Seconds;
+			sum += r * r;
+		}
+		return sum;
+	};
+
+	double p[3] = {log(Axis[axis].Accel), log(Axis[axis].Velocity), Axis[axis].Settle};
+	double current = cost(p);
+	double lambda = 1e-3;
+	const double step[3] = {1e-4, 1e-4, 1e-5};
+	for (int iteration = 0; iteration < FIT_ITERATIONS; iteration++)
+	{
+		double jtj[3][3] = {{0}}, jtr[3] = {0};
+		for (const Sample& s : samples)
+		{
+			double r = model(p, s.Distance) - s.Seconds;
+			double j[3];
+			for (int k = 0; k < 3; k++)
+			{
+				double hi[3] = {p[0], p[1], p[2]}, lo[3] = {p[0], p[1], p[2]};
+				hi[k] += step[k];
+				lo[k] -= step[k];
+				j[k] = (model(hi, s.Distance) - model(lo, s.Distance)) / (2.0 * step[k]);
+			}
+			for (int a = 0; a < 3; a++)
+			{
+				jtr[a] += j[a] * r;
+				for (int b = 0; b < 3; b++)
+				{
+					jtj[a][b] += j[a] * j[b];
+				}
+			}
+		}
+		double lhs[3][3], rhs[3], delta[3];
+		for (int a = 0; a < 3; a++)
+		{
+			for (int b = 0; b < 3; b++)
+			{
+				lhs[a][b] = jtj[a][b];
+			}
+			lhs[a][a] += lambda * jtj[a][a] + 1e-12;
+			rhs[a] = -jtr[a];
+		}
+		if (!Solve3(lhs, rhs, delta))
+		{
+			break;
+		}
+		double trial[3] = {p[0] + delta[0], p[1] + delta[1], max(0.0, p[2] + delta[2])};
+		double trialCost = cost(trial);
+		if (trialCost < current)
+		{
+			bool converged = current - trialCost < 1e-12 * current;
+			copy(trial, trial + 3, p);
+			current = trialCost;
+			lambda = max(lambda / 10.0, 1e-9);
+			if (converged)
+			{
+				break;
+			}
+		}
+		else
+		{
+			lambda *= 10.0;
+		}
+	}
+
+	Axis[axis].Accel = exp(p[0]);
+	Axis[axis].Velocity = exp(p[1]);
+	Axis[axis].Settle = p[2];
+	Residual[axis] = sqrt(current / samples.size());
+	SampleCount[axis] = max(SampleCount[axis], (unsigned long)samples.size());
+}
+
+bool MotionModel::Load(const string& fileName)
+{
+	ifstream stream(fileName);
+	map<string, double> values;
+	string line, key;
+	double value;
+	while (getline(stream, line))
+	{
+		istringstream fields(line);
+		if (!line.empty() && line[0] != '#' && fields >> key >> value)
+		{
+			values[key] = value;
+		}
+	}
+	const char* prefix[2] = {"x", "y"};
+	for (int axis = 0; axis < 2; axis++)
+	{
+		string p = prefix[axis];
+		if (!values.count(p + "Accel") || !values.count(p + "Velocity") || !values.count(p + "Settle")
+			|| values[p + "Accel"] <= 0 || values[p + "Velocity"] <= 0)
+		{
+			return false;
+		}
+	}
+	for (int axis = 0; axis < 2; axis++)
+	{
+		string p = prefix[axis];
+		Axis[axis].Accel = values[p + "Accel"];
+		Axis[axis].Velocity = values[p + "Velocity"];
+		Axis[axis].Settle = values[p + "Settle"];
+		Residual[axis] = values[p + "Residual"];
+		SampleCount[axis] = (unsigned long)values[p + "Samples"];
+	}
+	return true;
+}
+
+bool MotionModel::Save(const string& fileName) const
+{
+	ofstream stream(fileName);
+	if (!stream)
+	{
+		return false;
+	}
+	stream << "# Stage motion model fitted from move-complete replies" << endl;
+	stream.precision(10);
+	const char* prefix[2] = {"x", "y"};
+	for (int axis = 0; axis < 2; axis++)
+	{
+		stream << prefix[axis] << "Accel " << Axis[axis].Accel << endl;
+		stream << prefix[axis] << "Velocity " << Axis[axis].Velocity << endl;
+		stream << prefix[axis] << "Settle " << Axis[axis].Settle << endl;
+		stream << prefix[axis] << "Residual " << Residual[axis] << endl;
+		stream << prefix[axis] << "Samples " << SampleCount[axis] << endl;
+	}
+	return (bool)stream;
+}
@@ -0,0 +1,96 @@
+/*------------------------------------------------------------------------
+ Module:        MOTIONMODEL.H
+ Project:       StepperMotor
+ Description:   Per-axis move time model (trapezoidal velocity profile
+                plus a fixed settle/reply overhead) fitted online from
+                measured move-complete times and kept between runs.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _MOTIONMODEL_H_
+#define _MOTIONMODEL_H_
+
+#include <deque>
+#include <string>
+
+#define MOTION_X 0
+#define MOTION_Y 1
+
+struct AxisMotion
+{
+	double Accel;    // microsteps/s^2
+	double Velocity; // cruise speed, microsteps/s
+	double Settle;   // seconds added to every move: settling and reply latency
+};
+
+// Drive settings for one move, per axis (MOTION_X, MOTION_Y).  A zero
+// velocity leaves that drive's settings as they are.
+struct MoveProfile
+{
+	double Velocity[2]; // microsteps/s
+	double Accel[2];    // microsteps/s^2
+	bool Eased[2];      // slowed to finish with the other axis
+};
+
+class MotionModel
+{
+public:
+	MotionModel();
+
+	// Seconds from command to move-complete reply for one axis
+	static double AxisSeconds(const AxisMotion& axis, double distance);
+
+	// Both axes move at once; the slower one decides
+	double MoveSeconds(double dx, double dy) const;
+
+	// Prediction plus margin, for bounding the wait on a move
+	unsigned long TimeoutMs(double dx, double dy) const;
+
+	// Settings for a move of (dx, dy).  The axis with further to go runs
+	// at Limit; the other has its profile stretched in time (velocity
+	// over k, acceleration over k squared) to arrive together with it,
+	// so it leaves less ringing for no loss of time.
+	MoveProfile Profile(double dx, double dy) const;
+
+	// Limit where set, the fitted values otherwise
+	AxisMotion Fastest(int axis) const;
+
+	// Margin above the prediction: generous until the fit has enough
+	// samples, then a few standard deviations of the fit residual
+	double MarginSeconds() const;
+
+	// Adds a measured move and refits every few samples
+	void Record(int axis, double distance, double seconds);
+	void Fit();
+
+	// Refits so far, for callers that cache predictions
+	unsigned long Fits() const { return FitCount; }
+
+	// Key-value text, as in the scan parameters file.  Load returns
+	// false (leaving the defaults) if the file is missing or incomplete.
+	bool Load(const std::string& fileName);
+	bool Save(const std::string& fileName) const;
+
+	AxisMotion Axis[2];
+
+	// Fastest velocity and acceleration the drives may be given; zero
+	// fields fall back to the fitted values.  Not saved with the model.
+	AxisMotion Limit[2];
+
+private:
+	struct Sample
+	{
+		double Distance;
+		double Seconds;
+	};
+
+	void FitAxis(int axis);
+
+	std::deque<Sample> Samples[2];
+	double Residual[2];          // RMS fit error, seconds
+	unsigned long SampleCount[2]; // samples behind the current fit, this run and before
+	unsigned long SinceFit[2];
+	unsigned long FitCount;
+};
+
+#endif
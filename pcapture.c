@@ -0,0 +1,239 @@
+/*------------------------------------------------------------------------
+ Module:        PCAPTURE.C
+ Project:       StepperMotor
+ Description:   Timestamped capture of raw serial traffic to a compact
+                binary log, and reading such logs back for replay.
+                Records go through a large stdio buffer, so capturing
+                costs a memcpy per transfer rather than a file write.
+                Language : C
+                Platform : Win32, POSIX
+------------------------------------------------------------------------*/
+
+#ifdef _WIN32
+#include <windows.h>  // QueryPerformanceCounter
+#else
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // clock_gettime under -std=c17
+#endif
+#include <time.h>     // clock_gettime
+#endif
+#include <stdio.h>
+#include <stdlib.h>   // malloc, free
+#include <string.h>
+#include "pcapture.h"
+
+#define FILEBUFFER 65536
+#define HEADERSIZE 8
+#define RECORDHEAD 10 // Timestamp, direction and length
+
+struct PCAPTURE
+{
+  FILE *File;
+  int Writing;           // Opened by PCAPTURE_Create
+  unsigned long Records; // Written or read so far
+};
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Nanoseconds ID:1
+ Purpose:       Monotonic clock used to stamp records
+ Input:         None
+ Output:        Nanoseconds from an arbitrary origin
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned long long PCAPTURE_Nanoseconds( void )
+{
+#ifdef _WIN32
+  static LARGE_INTEGER Frequency;
+  LARGE_INTEGER Count;
+  if ( Frequency.QuadPart == 0 )
+  {
+    QueryPerformanceFrequency( &Frequency );
+  }
+  QueryPerformanceCounter( &Count );
+  return (unsigned long long)( Count.QuadPart / Frequency.QuadPart ) * 1000000000ULL
+       + (unsigned long long)( Count.QuadPart % Frequency.QuadPart ) * 1000000000ULL
+         / (unsigned long long)Frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long long)ts.tv_sec * 1000000000ULL
+       + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Create ID:1
+ Purpose:       Creates (truncating) a capture file and writes its header
+ Input:         FileName
+ Output:        New capture, or NULL if the file cannot be created
+ Errors:        None
+------------------------------------------------------------------------*/
+PCAPTURE *PCAPTURE_Create( const char *FileName )
+{
+  static const unsigned char Header[HEADERSIZE] =
+  {
+    'Z', 'C', 'A', 'P', PCAPTURE_VERSION, 0, 0, 0
+  };
+  PCAPTURE *Capture = (PCAPTURE *)malloc( sizeof(PCAPTURE) );
+
+  if ( Capture == NULL )
+  {
+    return NULL;
+  }
+  Capture->File = fopen( FileName, "wb" );
+  if ( Capture->File == NULL )
+  {
+    free( Capture );
+    return NULL;
+  }
+  setvbuf( Capture->File, NULL, _IOFBF, FILEBUFFER );
+  fwrite( Header, 1, HEADERSIZE, Capture->File );
+  Capture->Writing = 1;
+  Capture->Records = 0;
+  return Capture;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Open ID:1
+ Purpose:       Opens an existing capture file for reading
+ Input:         FileName
+ Output:        Capture positioned at the first record, or NULL if the
+                file is missing or not a capture of this version
+ Errors:        None
+------------------------------------------------------------------------*/
+PCAPTURE *PCAPTURE_Open( const char *FileName )
+{
+  unsigned char Header[HEADERSIZE];
+  PCAPTURE *Capture = (PCAPTURE *)malloc( sizeof(PCAPTURE) );
+
+  if ( Capture == NULL )
+  {
+    return NULL;
+  }
+  Capture->File = fopen( FileName, "rb" );
+  if ( Capture->File == NULL )
+  {
+    free( Capture );
+    return NULL;
+  }
+  if ( fread( Header, 1, HEADERSIZE, Capture->File ) != HEADERSIZE
+       || memcmp( Header, "ZCAP", 4 ) != 0
+       || Header[4] != PCAPTURE_VERSION )
+  {
+    fclose( Capture->File );
+    free( Capture );
+    return NULL;
+  }
+  setvbuf( Capture->File, NULL, _IOFBF, FILEBUFFER );
+  Capture->Writing = 0;
+  Capture->Records = 0;
+  return Capture;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Record ID:1
+ Purpose:       Appends a transfer, stamped now.  Transfers longer than
+                255 bytes become several records with the same stamp.
+ Input:         Capture (NULL records nothing), Direction, Bytes, Count
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PCAPTURE_Record( PCAPTURE *Capture,
+                      unsigned char Direction,
+                      const unsigned char *Bytes,
+                      unsigned long Count )
+{
+  unsigned char Head[RECORDHEAD];
+  unsigned long long Now;
+  unsigned long Length;
+  int i;
+
+  if ( Capture == NULL || !Capture->Writing || Count == 0 )
+  {
+    return;
+  }
+  Now = PCAPTURE_Nanoseconds();
+  for ( i = 0; i < 8; i++ )
+  {
+    Head[i] = (unsigned char)( Now >> ( 8 * i ) );
+  }
+  Head[8] = Direction;
+  while ( Count > 0 )
+  {
+    Length = Count < 255 ? Count : 255;
+    Head[9] = (unsigned char)Length;
+    fwrite( Head, 1, RECORDHEAD, Capture->File );
+    fwrite( Bytes, 1, Length, Capture->File );
+    Capture->Records++;
+    Bytes += Length;
+    Count -= Length;
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Read ID:1
+ Purpose:       Reads the next record
+ Input:         Capture, Record
+ Output:        TRUE if a record was read, FALSE at the end of the file
+                or on a truncated record
+ Errors:        None
+------------------------------------------------------------------------*/
+int PCAPTURE_Read( PCAPTURE *Capture, PCAPTURE_RECORD *Record )
+{
+  unsigned char Head[RECORDHEAD];
+  int i;
+
+  if ( Capture->Writing
+       || fread( Head, 1, RECORDHEAD, Capture->File ) != RECORDHEAD )
+  {
+    return 0;
+  }
+  Record->Nanoseconds = 0;
+  for ( i = 7; i >= 0; i-- )
+  {
+    Record->Nanoseconds = ( Record->Nanoseconds << 8 ) | Head[i];
+  }
+  Record->Direction = Head[8];
+  Record->Length = Head[9];
+  if ( fread( Record->Bytes, 1, Record->Length, Capture->File ) != Record->Length )
+  {
+    return 0;
+  }
+  Capture->Records++;
+  return 1;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Records ID:1
+ Purpose:       Number of records written or read so far
+ Input:         Capture
+ Output:        Record count
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned long PCAPTURE_Records( const PCAPTURE *Capture )
+{
+  return Capture->Records;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PCAPTURE_Close ID:1
+ Purpose:       Flushes and closes the file and releases the capture
+ Input:         Capture (may be NULL)
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PCAPTURE_Close( PCAPTURE *Capture )
+{
+  if ( Capture != NULL )
+  {
+    fclose( Capture->File );
+    free( Capture );
+  }
+}
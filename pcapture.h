@@ -0,0 +1,56 @@
+/*------------------------------------------------------------------------
+ Module:        PCAPTURE.H
+ Project:       StepperMotor
+ Description:   Timestamped capture of raw serial traffic to a compact
+                binary log, and reading such logs back for replay.
+                Language : C
+                Platform : Win32, POSIX
+------------------------------------------------------------------------*/
+
+#ifndef _PCAPTURE_H_
+#define _PCAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCAPTURE_TX 0 // Host to chain
+#define PCAPTURE_RX 1 // Chain to host
+
+// File layout: "ZCAP", a little-endian 32-bit version, then records of
+// a little-endian 64-bit nanosecond timestamp, direction byte, length
+// byte and that many bytes exactly as written to or read from the port.
+#define PCAPTURE_VERSION 1
+
+typedef struct
+{
+  unsigned long long Nanoseconds; // Monotonic, arbitrary origin
+  unsigned char Direction;        // PCAPTURE_TX or PCAPTURE_RX
+  unsigned char Length;           // Bytes used in Bytes
+  unsigned char Bytes[255];
+} PCAPTURE_RECORD;
+
+typedef struct PCAPTURE PCAPTURE;
+
+extern unsigned long long PCAPTURE_Nanoseconds( void );
+
+extern PCAPTURE *PCAPTURE_Create( const char *FileName );
+
+extern PCAPTURE *PCAPTURE_Open( const char *FileName );
+
+extern void PCAPTURE_Record( PCAPTURE *Capture,
+                             unsigned char Direction,
+                             const unsigned char *Bytes,
+                             unsigned long Count );
+
+extern int PCAPTURE_Read( PCAPTURE *Capture, PCAPTURE_RECORD *Record );
+
+extern unsigned long PCAPTURE_Records( const PCAPTURE *Capture );
+
+extern void PCAPTURE_Close( PCAPTURE *Capture );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
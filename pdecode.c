@@ -0,0 +1,268 @@
+/*------------------------------------------------------------------------
+ Module:        PDECODE.C
+ Project:       StepperMotor
+ Description:   Ring-buffered packet decoder for the Zaber 6-byte
+                binary protocol.  Bytes are appended in bulk, every
+                complete packet can be taken in one call, and framing
+                is recovered by sliding over bytes whose unit/command
+                header is not plausible, rather than by waiting for
+                the receive timeout to clear the buffer.
+                Language : C
+                Platform : Any
+------------------------------------------------------------------------*/
+
+#include <string.h>
+#include "pdecode.h"
+
+#define RINGMASK (PDECODE_RINGSIZE - 1)
+
+// Reply commands a Zaber binary device may send back unprompted or in
+// answer to a request.  Anything else in the command byte means the
+// stream is misaligned.
+static const unsigned char DefaultCommands[] =
+{
+  0,  1,  2,  8,  9, 10, 11, 13, 16, 17, 18, 20, 21, 22, 23,
+  35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49,
+  50, 51, 52, 53, 54, 55, 56, 60, 63, 255
+};
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Init ID:1
+ Purpose:       Empties the ring and loads the default set of plausible
+                reply commands
+ Input:         State, MaxUnit (number of units in the daisy chain)
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PDECODE_Init( PDECODE_STATE *State, unsigned char MaxUnit )
+{
+  unsigned int i;
+
+  memset( State, 0, sizeof(*State) );
+  State->MinUnit = 1; // Replies always carry the sender's own number
+  State->MaxUnit = MaxUnit;
+  for ( i = 0; i < sizeof(DefaultCommands); i++ )
+  {
+    PDECODE_AllowCommand( State, DefaultCommands[i] );
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Reset ID:1
+ Purpose:       Drops every buffered byte, keeping the configuration
+ Input:         State
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PDECODE_Reset( PDECODE_STATE *State )
+{
+  State->Head = State->Tail;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_AllowCommand ID:1
+ Purpose:       Marks a reply command number as plausible
+ Input:         State, Command
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PDECODE_AllowCommand( PDECODE_STATE *State, unsigned char Command )
+{
+  State->Commands[Command >> 3] |= (unsigned char)(1 << (Command & 7));
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Pending ID:1
+ Purpose:       Number of buffered bytes not yet decoded
+ Input:         State
+ Output:        Byte count
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned int PDECODE_Pending( const PDECODE_STATE *State )
+{
+  return State->Tail - State->Head;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_WriteSpan ID:1
+ Purpose:       Exposes the largest contiguous free region of the ring
+                so a driver can read() straight into it.  Follow with
+                PDECODE_Commit.
+ Input:         State
+ Output:        Span points at the free region; returns its length
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned int PDECODE_WriteSpan( PDECODE_STATE *State, unsigned char **Span )
+{
+  unsigned int Free = PDECODE_RINGSIZE - PDECODE_Pending( State );
+  unsigned int Offset = State->Tail & RINGMASK;
+  unsigned int ToEnd = PDECODE_RINGSIZE - Offset;
+
+  *Span = State->Ring + Offset;
+  return Free < ToEnd ? Free : ToEnd;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Commit ID:1
+ Purpose:       Accounts for Count bytes written through the span
+                returned by PDECODE_WriteSpan
+ Input:         State, Count
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PDECODE_Commit( PDECODE_STATE *State, unsigned int Count )
+{
+  State->Tail += Count;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Push ID:1
+ Purpose:       Copies bytes into the ring.  If the ring is full the
+                oldest bytes are overwritten and counted as discarded.
+ Input:         State, Bytes, Count
+ Output:        Number of bytes stored
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned int PDECODE_Push( PDECODE_STATE *State,
+                           const unsigned char *Bytes,
+                           unsigned int Count )
+{
+  unsigned int i;
+
+  for ( i = 0; i < Count; i++ )
+  {
+    if ( PDECODE_Pending( State ) == PDECODE_RINGSIZE )
+    {
+      State->Head++;
+      State->Discarded++;
+    }
+    State->Ring[State->Tail & RINGMASK] = Bytes[i];
+    State->Tail++;
+  }
+  return Count;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Plausible ID:1
+ Purpose:       Checks whether the two bytes at Offset past Head could
+                be the unit and command of a reply packet
+ Input:         State, Offset
+ Output:        TRUE if plausible
+ Errors:        None
+------------------------------------------------------------------------*/
+static int PDECODE_Plausible( const PDECODE_STATE *State, unsigned int Offset )
+{
+  unsigned char Unit = State->Ring[(State->Head + Offset) & RINGMASK];
+  unsigned char Command = State->Ring[(State->Head + Offset + 1) & RINGMASK];
+
+  if ( Unit < State->MinUnit || Unit > State->MaxUnit )
+  {
+    return 0;
+  }
+  return (State->Commands[Command >> 3] >> (Command & 7)) & 1;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Aligned ID:1
+ Purpose:       Decides whether Head sits on a packet boundary.  The
+                header must be plausible; when the following header is
+                also buffered and is not, Head is only trusted if no
+                shorter shift yields a plausible pair of headers.
+ Input:         State
+ Output:        TRUE if a packet can be taken at Head
+ Errors:        None
+------------------------------------------------------------------------*/
+static int PDECODE_Aligned( const PDECODE_STATE *State )
+{
+  unsigned int Pending = PDECODE_Pending( State );
+  unsigned int Shift;
+
+  if ( !PDECODE_Plausible( State, 0 ) )
+  {
+    return 0;
+  }
+  if ( Pending < 2 * PSERIAL_PACKETSIZE
+       || PDECODE_Plausible( State, PSERIAL_PACKETSIZE ) )
+  {
+    return 1;
+  }
+  for ( Shift = 1;
+        Shift < PSERIAL_PACKETSIZE
+        && Shift + 2 * PSERIAL_PACKETSIZE <= Pending;
+        Shift++ )
+  {
+    if ( PDECODE_Plausible( State, Shift )
+         && PDECODE_Plausible( State, Shift + PSERIAL_PACKETSIZE ) )
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Next ID:1
+ Purpose:       Takes the next complete packet from the ring,
+                discarding bytes one at a time until the stream is
+                aligned on a plausible header
+ Input:         State
+ Output:        Returns TRUE and fills Packet if one was decoded
+ Errors:        None
+------------------------------------------------------------------------*/
+int PDECODE_Next( PDECODE_STATE *State, PSERIAL_PACKET *Packet )
+{
+  const unsigned char *Ring = State->Ring;
+  unsigned int Head;
+
+  while ( PDECODE_Pending( State ) >= PSERIAL_PACKETSIZE )
+  {
+    if ( !PDECODE_Aligned( State ) )
+    {
+      State->Head++;
+      State->Discarded++;
+      continue;
+    }
+    Head = State->Head;
+    Packet->Unit    = Ring[Head & RINGMASK];
+    Packet->Command = Ring[(Head + 1) & RINGMASK];
+    // Position 2 is LSB; Position 5 is MSB
+    Packet->Data = (long)(int)( ((unsigned long)Ring[(Head + 2) & RINGMASK]      )
+                              | ((unsigned long)Ring[(Head + 3) & RINGMASK] <<  8)
+                              | ((unsigned long)Ring[(Head + 4) & RINGMASK] << 16)
+                              | ((unsigned long)Ring[(Head + 5) & RINGMASK] << 24) );
+    State->Head += PSERIAL_PACKETSIZE;
+    return 1;
+  }
+  return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PDECODE_Drain ID:1
+ Purpose:       Takes every complete packet currently in the ring
+ Input:         State, MaxPackets
+ Output:        Number of packets written to Packets
+ Errors:        None
+------------------------------------------------------------------------*/
+int PDECODE_Drain( PDECODE_STATE *State,
+                   PSERIAL_PACKET *Packets,
+                   int MaxPackets )
+{
+  int Count = 0;
+
+  while ( Count < MaxPackets && PDECODE_Next( State, &Packets[Count] ) )
+  {
+    Count++;
+  }
+  return Count;
+}
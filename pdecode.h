@@ -0,0 +1,60 @@
+/*------------------------------------------------------------------------
+ Module:        PDECODE.H
+ Project:       StepperMotor
+ Description:   Ring-buffered packet decoder for the Zaber 6-byte
+                binary protocol.
+                Language : C
+                Platform : Any
+------------------------------------------------------------------------*/
+
+#ifndef _PDECODE_H_
+#define _PDECODE_H_
+
+#include "pserial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PDECODE_RINGSIZE 256 // must be a power of two
+
+typedef struct
+{
+  unsigned char Ring[PDECODE_RINGSIZE]; // Raw received bytes
+  unsigned int Head;                    // Next byte to decode (free running)
+  unsigned int Tail;                    // Next free slot (free running)
+  unsigned char MinUnit;                // Lowest unit number accepted
+  unsigned char MaxUnit;                // Highest unit number in the chain
+  unsigned char Commands[32];           // Bitmap of plausible reply commands
+  unsigned long Discarded;              // Bytes dropped while resynchronising
+} PDECODE_STATE;
+
+extern void PDECODE_Init( PDECODE_STATE *State, unsigned char MaxUnit );
+
+extern void PDECODE_Reset( PDECODE_STATE *State );
+
+extern void PDECODE_AllowCommand( PDECODE_STATE *State,
+                                  unsigned char Command );
+
+extern unsigned int PDECODE_Pending( const PDECODE_STATE *State );
+
+extern unsigned int PDECODE_WriteSpan( PDECODE_STATE *State,
+                                       unsigned char **Span );
+
+extern void PDECODE_Commit( PDECODE_STATE *State, unsigned int Count );
+
+extern unsigned int PDECODE_Push( PDECODE_STATE *State,
+                                  const unsigned char *Bytes,
+                                  unsigned int Count );
+
+extern int PDECODE_Next( PDECODE_STATE *State, PSERIAL_PACKET *Packet );
+
+extern int PDECODE_Drain( PDECODE_STATE *State,
+                          PSERIAL_PACKET *Packets,
+                          int MaxPackets );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
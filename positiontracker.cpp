@@ -0,0 +1,67 @@
+/*------------------------------------------------------------------------
+ Module:        POSITIONTRACKER.CPP
+ Project:       StepperMotor
+ Description:   Dead-reckoned X/Y stage position.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <iostream>
+
+#include "positiontracker.h"
+
+using namespace std;
+
+PositionTracker::PositionTracker(XYStage& stage, unsigned int verifyEvery)
+	: Stage(stage), VerifyEvery(verifyEvery), SinceVerify(0), Doubtful(true),
+	  TrackedX(0), TrackedY(0), VerifyCount(0), MismatchCount(0)
+{
+}
+
+bool PositionTracker::NeedsVerify() const
+{
+	return Doubtful || SinceVerify >= VerifyEvery;
+}
+
+bool PositionTracker::Verify(unsigned long timeoutMs)
+{
+	long x, y;
+	if (!Stage.GetPositions(&x, &y, timeoutMs))
+	{
+		Doubtful = true;
+		return false;
+	}
+	VerifyCount++;
+	if (!Doubtful && (x != TrackedX || y != TrackedY))
+	{
+		MismatchCount++;
+		cout << "Warning: drives are at " << x << ", " << y << " but were tracked at "
+			<< TrackedX << ", " << TrackedY << endl;
+	}
+	TrackedX = x;
+	TrackedY = y;
+	Doubtful = false;
+	SinceVerify = 0;
+	return true;
+}
+
+void PositionTracker::Moved(long x, long y, const MoveResult& move)
+{
+	SinceVerify++;
+	if (move.Arrived)
+	{
+		// Move-absolute replies carry where each drive actually stopped
+		TrackedX = move.X;
+		TrackedY = move.Y;
+		if (move.X != x || move.Y != y)
+		{
+			Doubtful = true;
+		}
+	}
+	else
+	{
+		// Still moving, stalled or rejected: assume the command and check
+		TrackedX = x;
+		TrackedY = y;
+		Doubtful = true;
+	}
+}
@@ -0,0 +1,51 @@
+/*------------------------------------------------------------------------
+ Module:        POSITIONTRACKER.H
+ Project:       StepperMotor
+ Description:   Dead-reckoned X/Y stage position.  Moves that complete
+                where they were commanded are trusted; the drives are
+                only queried every few moves, or after a move that
+                timed out or stopped short.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _POSITIONTRACKER_H_
+#define _POSITIONTRACKER_H_
+
+#include "xystage.h"
+
+class PositionTracker
+{
+public:
+	// verifyEvery of 0 or 1 queries the drives before every move
+	PositionTracker(XYStage& stage, unsigned int verifyEvery);
+
+	// True when the position has not been confirmed for verifyEvery
+	// moves, or is in doubt
+	bool NeedsVerify() const;
+
+	// Asks the drives where they are.  Returns false, leaving the
+	// position in doubt, if they do not answer in time.
+	bool Verify(unsigned long timeoutMs);
+
+	// Records the outcome of a move commanded to (x, y)
+	void Moved(long x, long y, const MoveResult& move);
+
+	long X() const { return TrackedX; }
+	long Y() const { return TrackedY; }
+	bool Known() const { return !Doubtful; }
+
+	unsigned long Verifications() const { return VerifyCount; }
+	unsigned long Mismatches() const { return MismatchCount; } // verified position differed from tracked
+
+private:
+	XYStage& Stage;
+	unsigned int VerifyEvery;
+	unsigned int SinceVerify;
+	bool Doubtful;
+	long TrackedX;
+	long TrackedY;
+	unsigned long VerifyCount;
+	unsigned long MismatchCount;
+};
+
+#endif
@@ -5,145 +5,823 @@
  State:
  Creation Date: 27 June 2001
  Description:   Serial port API for Zaber Techmo units.
+                Received bytes are framed by PDECODE.C.
+                Each PSERIAL_PORT owns its handle and receive state, so
+                several ports may be driven at once, one per thread.
+                The original PSERIAL_* calls operate on a built-in
+                default port.
                 Language : C
-                Platform : Win32
-                Serial   : Polled mode operation
+                Platform : Win32, POSIX (termios)
+                Serial   : Polled mode operation, or blocking with
+                           a deadline through PSERIAL_ReceiveWait
 ------------------------------------------------------------------------*/
 
 
+#ifdef _WIN32
 #include <windows.h>  // This provides all the file handling routines
 #include <mmsystem.h> // This include file is necessary to use the timer function
                       // MUST INCLUDE "winmm.lib" AT LINK TIME
+#else
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // cfmakeraw, CRTSCTS and clock_gettime under -std=c17
+#endif
+#include <fcntl.h>    // open
+#include <poll.h>     // poll, used to block until the port is readable
+#include <termios.h>  // Serial line settings
+#include <time.h>     // clock_gettime
+#include <unistd.h>   // read, write, close
+
+#define INVALID_HANDLE_VALUE (-1)
+#define TRUE  1
+#define FALSE 0
+
+typedef int HANDLE;
+#endif
+#include <stdio.h>    // sprintf
+#include <stdlib.h>   // malloc, free
 #include "pserial.h"  // Header file for this API
+#include "pdecode.h"  // Ring-buffered packet decoder
+#include "pcapture.h" // Optional traffic recorder
 
 #define RXTIMEOUT 500 //milliseconds
 
-static HANDLE PortHandle; // Handle to the serial port
-static DCB dcb;           // Device control block of the serial port (structure)
-static COMMTIMEOUTS ctmo; // Timeout values for the serial port (structure)
+struct PSERIAL_PORT
+{
+  HANDLE PortHandle;          // Handle to the serial port
+#ifdef _WIN32
+  DCB dcb;                    // Device control block of the serial port (structure)
+  COMMTIMEOUTS ctmo;          // Timeout values for the serial port (structure)
+  unsigned long RxWaitMs;     // Read timeout currently programmed in ctmo
+  HANDLE ReadEvent;           // Completes the overlapped ReadFile
+  HANDLE WriteEvent;          // Completes the overlapped WriteFile
+  HANDLE WakeEvent;           // Auto-reset; PSERIAL_PortWake sets it, waits take it
+#else
+  int WakePipe[2];            // PSERIAL_PortWake writes, waits poll the read end
+#endif
+  int Woken;                  // the last wait ended early on PSERIAL_PortWake
 
-static unsigned long BytesWritten; // used by the WriteFile command to return bytes written
-static unsigned long BytesRead;    // used by the ReadFile command to return bytes read
+  unsigned long BytesWritten; // used by the WriteFile command to return bytes written
+  unsigned long BytesRead;    // used by the ReadFile command to return bytes read
 
-static unsigned char TxBuffer[PSERIAL_PACKETSIZE]; // Transmit buffer for data packets
-static unsigned char RxBuffer[PSERIAL_PACKETSIZE]; // Receive buffer for data packets
-static int RxCount;                           // counter to keep track of receive status
-static unsigned long RxTimeStamp;             // Timestamp used to expire incomplete packets
+  unsigned char TxBuffer[PSERIAL_PACKETSIZE * PSERIAL_MAXBATCH]; // Transmit buffer for data packets
+  PDECODE_STATE Rx;           // Receive ring and packet framing state
+  unsigned long RxTimeStamp;  // Timestamp used to expire incomplete packets
+  PCAPTURE *Capture;          // Traffic recorder, NULL when not capturing
+};
+
+static PSERIAL_PORT DefaultPort; // Port used by the original PSERIAL_* calls
 
 
 /*------------------------------------------------------------------------
- Procedure:     PSERIAL_Initialize ID:1
- Purpose:       Initializes the serial communication API Must be
-                called before using any other functions in the API
+ Procedure:     PSERIAL_Ticks ID:1
+ Purpose:       Millisecond tick counter used for packet expiry and
+                receive deadlines
  Input:         None
+ Output:        Milliseconds from an arbitrary, monotonic origin
+ Errors:        None
+------------------------------------------------------------------------*/
+static unsigned long PSERIAL_Ticks ( void )
+{
+#ifdef _WIN32
+  return timeGetTime();
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (unsigned long)ts.tv_sec * 1000UL
+       + (unsigned long)(ts.tv_nsec / 1000000L);
+#endif
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_ReadBytes ID:1
+ Purpose:       Reads whatever is available up to MaxBytes.  With a
+                WaitMs of zero it returns at once; otherwise it sleeps
+                in the driver until the first byte arrives or WaitMs
+                expires, then returns every byte already received.
+ Input:         Port, Buffer, MaxBytes, WaitMs
+ Output:        Number of bytes read (0 on timeout or error)
+ Errors:        None
+------------------------------------------------------------------------*/
+static unsigned long PSERIAL_ReadBytes( PSERIAL_PORT *Port,
+                                        unsigned char *Buffer,
+                                        unsigned long MaxBytes,
+                                        unsigned long WaitMs )
+{
+#ifdef _WIN32
+  // MAXDWORD/MAXDWORD/n makes ReadFile return immediately with any
+  // queued bytes, or wait up to n ms for the first one to arrive.
+  // MAXDWORD/0/0 is the original non-blocking poll.  The read is
+  // overlapped so a wait can also end on the wake event; that event
+  // stays set until a wait takes it, so no wake is ever lost.
+  OVERLAPPED Overlapped;
+  HANDLE Events[2];
+  if ( WaitMs != Port->RxWaitMs )
+  {
+    Port->ctmo.ReadIntervalTimeout = MAXDWORD;
+    Port->ctmo.ReadTotalTimeoutMultiplier = WaitMs ? MAXDWORD : 0;
+    Port->ctmo.ReadTotalTimeoutConstant = WaitMs;
+    SetCommTimeouts( Port->PortHandle, &Port->ctmo );
+    Port->RxWaitMs = WaitMs;
+  }
+  Port->BytesRead = 0;
+  ZeroMemory( &Overlapped, sizeof(Overlapped) );
+  Overlapped.hEvent = Port->ReadEvent;
+  if ( !ReadFile( Port->PortHandle,
+                  Buffer,            // Where to put the bytes read
+                  MaxBytes,          // up to the free space in the ring
+                  &Port->BytesRead,  // Bytes actually read
+                  &Overlapped ) )
+  {
+    if ( GetLastError() != ERROR_IO_PENDING )
+    {
+      Port->BytesRead = 0;
+    }
+    else
+    {
+      Events[0] = Port->ReadEvent;
+      Events[1] = Port->WakeEvent;
+      if ( WaitMs > 0
+           && WaitForMultipleObjects( 2, Events, FALSE, INFINITE ) == WAIT_OBJECT_0 + 1 )
+      {
+        // Woken: stop the read, keeping any bytes it already has
+        CancelIo( Port->PortHandle );
+        Port->Woken = TRUE;
+      }
+      if ( !GetOverlappedResult( Port->PortHandle, &Overlapped, &Port->BytesRead, TRUE ) )
+      {
+        Port->BytesRead = 0;
+      }
+    }
+  }
+#else
+  ssize_t Count;
+  if ( WaitMs > 0 )
+  {
+    struct pollfd pfd[2];
+    char Drain[64];
+    pfd[0].fd = Port->PortHandle;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = Port->WakePipe[0];
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    if ( poll( pfd, Port->WakePipe[0] >= 0 ? 2 : 1, (int)WaitMs ) <= 0 )
+    {
+      return 0; // Deadline passed (or interrupted) with nothing to read
+    }
+    if ( pfd[1].revents & POLLIN )
+    {
+      while ( read( Port->WakePipe[0], Drain, sizeof(Drain) ) > 0 )
+      {
+      }
+      if ( !(pfd[0].revents & POLLIN) )
+      {
+        Port->Woken = TRUE;
+        return 0;
+      }
+    }
+  }
+  Count = read( Port->PortHandle, Buffer, MaxBytes );
+  Port->BytesRead = Count > 0 ? (unsigned long)Count : 0;
+#endif
+  PCAPTURE_Record( Port->Capture, PCAPTURE_RX, Buffer, Port->BytesRead );
+  return Port->BytesRead;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortInit ID:1
+ Purpose:       Puts a port structure into its closed, empty state
+ Input:         Port, Units (number of units in the daisy chain)
  Output:        None
  Errors:        None
 ------------------------------------------------------------------------*/
-void PSERIAL_Initialize ( void )
+static void PSERIAL_PortInit( PSERIAL_PORT *Port, unsigned char Units )
 {
   // Initialize the handle to an invalid value
-  // So that PSERIAL_GetPortHandle can be called to see if port is open
+  // So that PSERIAL_PortIsOpen can be called to see if port is open
   // at all times.
-  PortHandle = INVALID_HANDLE_VALUE;
+  Port->PortHandle = INVALID_HANDLE_VALUE;
 
   // Miscelaneous initialization
-  BytesWritten = 0;
-  BytesRead = 0;
+  Port->BytesWritten = 0;
+  Port->BytesRead = 0;
+#ifdef _WIN32
+  Port->RxWaitMs = 0;
+  Port->ReadEvent = NULL;
+  Port->WriteEvent = NULL;
+  Port->WakeEvent = NULL;
+#else
+  Port->WakePipe[0] = Port->WakePipe[1] = -1;
+#endif
+  Port->Woken = FALSE;
 
-  RxCount = 0;
-  RxTimeStamp = timeGetTime();
+  PDECODE_Init( &Port->Rx, Units );
+  Port->RxTimeStamp = PSERIAL_Ticks();
+  Port->Capture = NULL;
 }
 
 
 /*------------------------------------------------------------------------
- Procedure:     PSERIAL_Open ID:1
+ Procedure:     PSERIAL_PortCreate ID:1
+ Purpose:       Allocates an independent, closed port
+ Input:         Units (number of units in the daisy chain)
+ Output:        New port, or NULL if out of memory
+ Errors:        None
+------------------------------------------------------------------------*/
+PSERIAL_PORT *PSERIAL_PortCreate( unsigned char Units )
+{
+  PSERIAL_PORT *Port = (PSERIAL_PORT *)malloc( sizeof(PSERIAL_PORT) );
+  if ( Port != NULL )
+  {
+    PSERIAL_PortInit( Port, Units );
+  }
+  return Port;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortDestroy ID:1
+ Purpose:       Closes the port if needed and releases it
+ Input:         Port
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortDestroy( PSERIAL_PORT *Port )
+{
+  if ( Port != NULL )
+  {
+    PSERIAL_PortClose( Port );
+    free( Port );
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortSetUnits ID:1
+ Purpose:       Tells the decoder how many units are daisy-chained so
+                replies from impossible unit numbers are treated as
+                framing errors
+ Input:         Port, Units
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortSetUnits( PSERIAL_PORT *Port, unsigned char Units )
+{
+  Port->Rx.MaxUnit = Units;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortSetCapture ID:1
+ Purpose:       Records every byte written to or read from the port
+                into Capture, timestamped, until called again with
+                NULL.  The caller keeps ownership of Capture.
+ Input:         Port, Capture (NULL stops recording)
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortSetCapture( PSERIAL_PORT *Port, PCAPTURE *Capture )
+{
+  Port->Capture = Capture;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortIsOpen ID:1
+ Purpose:       Reports whether the port currently has a handle
+ Input:         Port
+ Output:        TRUE if open
+ Errors:        None
+------------------------------------------------------------------------*/
+int PSERIAL_PortIsOpen( const PSERIAL_PORT *Port )
+{
+  return INVALID_HANDLE_VALUE != Port->PortHandle;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortOpenBaud ID:1
  Purpose:       Attempts to open a serial port and set up the port
-                for communication with Teckmo chains
- Input:         PortName
+                for communication with Teckmo chains at Baud,n,8,1
+                (9600 for the binary protocol, 115200 for ASCII)
+ Input:         Port, PortName ("com3" on Win32, "/dev/ttyUSB0" on POSIX),
+                Baud
  Output:        Error Code
  Errors:        If the function succeeded, returns TRUE
                 If the function failed, returns FALSE.
-                Call GetLastError() to get extended error info.
+                Call GetLastError() (errno on POSIX) to get extended
+                error info.
 ------------------------------------------------------------------------*/
-int PSERIAL_Open ( const char *PortName )
+int PSERIAL_PortOpenBaud( PSERIAL_PORT *Port,
+                          const char *PortName,
+                          unsigned long Baud )
 {
-  // Check that a port is not already opened for this application
-	if ( INVALID_HANDLE_VALUE != PortHandle )
-	{
-	  return FALSE;
-	}
+#ifdef _WIN32
+  char Mode[32];
+#else
+  struct termios tio;
+  speed_t Speed;
+#endif
+
+  // Check that a port is not already opened for this structure
+  if ( INVALID_HANDLE_VALUE != Port->PortHandle )
+  {
+    return FALSE;
+  }
+#ifdef _WIN32
+  sprintf( Mode, "%lu,n,8,1", Baud );
 	// Open the port
-  PortHandle = CreateFile( PortName,
-                           GENERIC_READ | GENERIC_WRITE,
-                           0,
-                           0,
-                           OPEN_EXISTING,
-                           FILE_ATTRIBUTE_NORMAL, //not FILE_FLAG_OVERLAPPED,
-                           0 );
-  if ( PortHandle == INVALID_HANDLE_VALUE )
+  Port->PortHandle = CreateFile( PortName,
+                                 GENERIC_READ | GENERIC_WRITE,
+                                 0,
+                                 0,
+                                 OPEN_EXISTING,
+                                 FILE_FLAG_OVERLAPPED, // so waits can be woken
+                                 0 );
+  if ( Port->PortHandle == INVALID_HANDLE_VALUE )
   {
     // CreateFile failed -- the port could already be in use.
     return FALSE;
   }
+  Port->ReadEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+  Port->WriteEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+  Port->WakeEvent = CreateEvent( NULL, FALSE, FALSE, NULL );
+  if ( Port->ReadEvent == NULL || Port->WriteEvent == NULL || Port->WakeEvent == NULL )
+  {
+    PSERIAL_PortClose( Port );
+    return FALSE;
+  }
   // Set the Device Control Block
-  ZeroMemory(&dcb, sizeof(dcb));
-  dcb.DCBlength = sizeof(dcb);
-  if (!BuildCommDCB("9600,n,8,1", &dcb))
+  ZeroMemory(&Port->dcb, sizeof(Port->dcb));
+  Port->dcb.DCBlength = sizeof(Port->dcb);
+  if (!BuildCommDCB(Mode, &Port->dcb))
   {
     // Error building DCB
-    CloseHandle( PortHandle );
-    PortHandle = INVALID_HANDLE_VALUE;
+    PSERIAL_PortClose( Port );
     return FALSE;
   }
-  if (!SetCommState( PortHandle, &dcb ))
+  if (!SetCommState( Port->PortHandle, &Port->dcb ))
   {
     // Error setting DCB parameters
-    CloseHandle( PortHandle );
-    PortHandle = INVALID_HANDLE_VALUE;
+    PSERIAL_PortClose( Port );
     return FALSE;
   }
 
   // Set Timeouts
-  ctmo.ReadIntervalTimeout = MAXDWORD;
-  ctmo.ReadTotalTimeoutMultiplier = 0;
-  ctmo.ReadTotalTimeoutConstant = 0;
-  ctmo.WriteTotalTimeoutMultiplier = 0;
-  ctmo.WriteTotalTimeoutConstant = 0;
-  if (!SetCommTimeouts( PortHandle, &ctmo ))
+  Port->ctmo.ReadIntervalTimeout = MAXDWORD;
+  Port->ctmo.ReadTotalTimeoutMultiplier = 0;
+  Port->ctmo.ReadTotalTimeoutConstant = 0;
+  Port->ctmo.WriteTotalTimeoutMultiplier = 0;
+  Port->ctmo.WriteTotalTimeoutConstant = 0;
+  if (!SetCommTimeouts( Port->PortHandle, &Port->ctmo ))
   {
     // Error setting timeout parameters
-    CloseHandle( PortHandle );
-    PortHandle = INVALID_HANDLE_VALUE;
+    PSERIAL_PortClose( Port );
+    return FALSE;
+  }
+  Port->RxWaitMs = 0;
+#else
+  switch ( Baud )
+  {
+    case 9600:   Speed = B9600;   break;
+    case 19200:  Speed = B19200;  break;
+    case 38400:  Speed = B38400;  break;
+    case 57600:  Speed = B57600;  break;
+    case 115200: Speed = B115200; break;
+    default:     return FALSE;    // Not a rate Zaber devices support
+  }
+
+  // Non-blocking so that PSERIAL_Receive keeps its polled behaviour;
+  // blocking waits go through poll() in PSERIAL_ReadBytes instead.
+  Port->PortHandle = open( PortName, O_RDWR | O_NOCTTY | O_NONBLOCK );
+  if ( Port->PortHandle == INVALID_HANDLE_VALUE )
+  {
+    // open failed -- the port could be missing or already in use.
+    return FALSE;
+  }
+  // Raw Baud,n,8,1, no flow control
+  if ( tcgetattr( Port->PortHandle, &tio ) != 0 )
+  {
+    close( Port->PortHandle );
+    Port->PortHandle = INVALID_HANDLE_VALUE;
+    return FALSE;
+  }
+  cfmakeraw( &tio );
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed( &tio, Speed );
+  cfsetospeed( &tio, Speed );
+  if ( tcsetattr( Port->PortHandle, TCSANOW, &tio ) != 0 )
+  {
+    // Error setting line parameters
+    close( Port->PortHandle );
+    Port->PortHandle = INVALID_HANDLE_VALUE;
     return FALSE;
   }
+  tcflush( Port->PortHandle, TCIOFLUSH );
+  if ( pipe( Port->WakePipe ) == 0 )
+  {
+    fcntl( Port->WakePipe[0], F_SETFL, O_NONBLOCK );
+    fcntl( Port->WakePipe[1], F_SETFL, O_NONBLOCK );
+    fcntl( Port->WakePipe[0], F_SETFD, FD_CLOEXEC );
+    fcntl( Port->WakePipe[1], F_SETFD, FD_CLOEXEC );
+  }
+  else
+  {
+    Port->WakePipe[0] = Port->WakePipe[1] = -1; // waits run to their deadline
+  }
+#endif
 
+  PDECODE_Reset( &Port->Rx );
+  Port->RxTimeStamp = PSERIAL_Ticks();
   return TRUE;
 }
 
 
 /*------------------------------------------------------------------------
- Procedure:     PSERIAL_Close ID:1
+ Procedure:     PSERIAL_PortOpen ID:1
+ Purpose:       Opens a port at 9600,n,8,1 for the binary protocol
+ Input:         Port, PortName
+ Output:        TRUE on success, FALSE on failure
+ Errors:        See PSERIAL_PortOpenBaud
+------------------------------------------------------------------------*/
+int PSERIAL_PortOpen( PSERIAL_PORT *Port, const char *PortName )
+{
+  return PSERIAL_PortOpenBaud( Port, PortName, 9600 );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortClose ID:1
  Purpose:       Closes the serial communication port
+ Input:         Port
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortClose( PSERIAL_PORT *Port )
+{
+  if ( INVALID_HANDLE_VALUE != Port->PortHandle )
+  {
+#ifdef _WIN32
+    CloseHandle(Port->PortHandle);
+    if ( Port->ReadEvent != NULL )
+    {
+      CloseHandle( Port->ReadEvent );
+    }
+    if ( Port->WriteEvent != NULL )
+    {
+      CloseHandle( Port->WriteEvent );
+    }
+    if ( Port->WakeEvent != NULL )
+    {
+      CloseHandle( Port->WakeEvent );
+    }
+    Port->ReadEvent = Port->WriteEvent = Port->WakeEvent = NULL;
+#else
+    close(Port->PortHandle);
+    if ( Port->WakePipe[0] >= 0 )
+    {
+      close( Port->WakePipe[0] );
+      close( Port->WakePipe[1] );
+      Port->WakePipe[0] = Port->WakePipe[1] = -1;
+    }
+#endif
+    Port->PortHandle = INVALID_HANDLE_VALUE;
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_Fill ID:1
+ Purpose:       Drains everything the driver holds into the receive
+                ring, waiting at most WaitMs for the first byte.  A
+                partial packet left idle for RXTIMEOUT is dropped.
+ Input:         Port, WaitMs
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+static void PSERIAL_Fill( PSERIAL_PORT *Port, unsigned long WaitMs )
+{
+  unsigned char *Span;
+  unsigned int SpanSize;
+
+  if ( PDECODE_Pending( &Port->Rx ) < PSERIAL_PACKETSIZE
+       && PSERIAL_Ticks() - Port->RxTimeStamp > RXTIMEOUT )
+  {
+    PDECODE_Reset( &Port->Rx );
+    Port->RxTimeStamp = PSERIAL_Ticks();
+  }
+  for (;;)
+  {
+    SpanSize = PDECODE_WriteSpan( &Port->Rx, &Span );
+    if ( SpanSize == 0
+         || PSERIAL_ReadBytes( Port, Span, SpanSize, WaitMs ) == 0 )
+    {
+      return;
+    }
+    PDECODE_Commit( &Port->Rx, (unsigned int)Port->BytesRead );
+    Port->RxTimeStamp = PSERIAL_Ticks();  // reload timestamp
+    if ( Port->BytesRead < SpanSize )
+    {
+      return; // Driver is empty
+    }
+    WaitMs = 0; // Span was filled (ring wrapped); take the rest now
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortReceiveMany ID:1
+ Purpose:       Returns every complete packet available, reading the
+                driver in bulk.  Waits up to TimeoutMs for the first
+                packet if none is buffered yet.
+ Input:         Port, MaxPackets, TimeoutMs
+ Output:        Number of packets written to Packets
+ Errors:        None
+------------------------------------------------------------------------*/
+int PSERIAL_PortReceiveMany( PSERIAL_PORT *Port,
+                             PSERIAL_PACKET *Packets,
+                             int MaxPackets,
+                             unsigned long TimeoutMs )
+{
+  unsigned long Start = PSERIAL_Ticks();
+  unsigned long Elapsed = 0;
+  int Count = PDECODE_Drain( &Port->Rx, Packets, MaxPackets );
+
+  Port->Woken = FALSE;
+
+  if ( Count == MaxPackets )
+  {
+    return Count;
+  }
+  for (;;)
+  {
+    PSERIAL_Fill( Port, Count > 0 ? 0 : TimeoutMs - Elapsed );
+    Count += PDECODE_Drain( &Port->Rx, Packets + Count, MaxPackets - Count );
+    if ( Count > 0 || Port->Woken )
+    {
+      return Count;
+    }
+    Elapsed = PSERIAL_Ticks() - Start;
+    if ( Elapsed >= TimeoutMs )
+    {
+      return 0;
+    }
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortTransmit ID:1
+ Purpose:       Writes the first Count bytes of the transmit buffer
+ Input:         Port, Count
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+static void PSERIAL_PortTransmit( PSERIAL_PORT *Port, unsigned long Count )
+{
+  PSERIAL_PortWriteRaw( Port, Port->TxBuffer, Count );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_Pack ID:1
+ Purpose:       Encodes one packet into 6 bytes
+ Input:         Buffer, Unit, Command, Data
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+static void PSERIAL_Pack( unsigned char *TxBuffer,
+                          unsigned char Unit,
+                          unsigned char Command,
+                          long Data )
+{
+  TxBuffer[0] = Unit;
+  TxBuffer[1] = Command;
+  // Position 2 is LSB; Position 5 is MSB
+  TxBuffer[2] = (Data & 0x000000FF);
+  TxBuffer[3] = ((Data >> 8) & 0x000000FF);
+  TxBuffer[4] = ((Data >> 16) & 0x000000FF);
+  TxBuffer[5] = ((Data >> 24) & 0x000000FF);
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortSend ID:1
+ Purpose:       Write a packet to the serial port
+ Input:         Port
+                Unit
+                Command
+                Data
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortSend( PSERIAL_PORT *Port,
+                       unsigned char Unit,
+                       unsigned char Command,
+                       long Data )
+{
+  PSERIAL_Pack( Port->TxBuffer, Unit, Command, Data );
+  PSERIAL_PortTransmit( Port, PSERIAL_PACKETSIZE );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortSendMany ID:1
+ Purpose:       Writes several packets back to back in a single write,
+                so commands for different units leave the host together
+                and reach the chain one packet time apart at most.
+                More than PSERIAL_MAXBATCH packets are split into
+                several writes.
+ Input:         Port, Packets, Count
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortSendMany( PSERIAL_PORT *Port,
+                           const PSERIAL_PACKET *Packets,
+                           int Count )
+{
+  int Batched;
+  int i;
+
+  while ( Count > 0 )
+  {
+    Batched = Count < PSERIAL_MAXBATCH ? Count : PSERIAL_MAXBATCH;
+    for ( i = 0; i < Batched; i++ )
+    {
+      PSERIAL_Pack( Port->TxBuffer + i * PSERIAL_PACKETSIZE,
+                    Packets[i].Unit, Packets[i].Command, Packets[i].Data );
+    }
+    PSERIAL_PortTransmit( Port, (unsigned long)Batched * PSERIAL_PACKETSIZE );
+    Packets += Batched;
+    Count -= Batched;
+  }
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortReadRaw ID:1
+ Purpose:       Reads unframed bytes for text protocols, bypassing the
+                packet decoder.  Waits up to TimeoutMs for the first
+                byte, then returns everything already received.
+ Input:         Port, Buffer, MaxBytes, TimeoutMs
+ Output:        Number of bytes read
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned long PSERIAL_PortReadRaw( PSERIAL_PORT *Port,
+                                   unsigned char *Buffer,
+                                   unsigned long MaxBytes,
+                                   unsigned long TimeoutMs )
+{
+  Port->Woken = FALSE;
+  return PSERIAL_ReadBytes( Port, Buffer, MaxBytes, TimeoutMs );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortWake ID:1
+ Purpose:       Ends a PSERIAL_PortReceiveMany or PSERIAL_PortReadRaw
+                wait early, with nothing read, so its thread can send
+                what was just queued.  A wake with no wait under way
+                ends the next one at once.  The only call that may be
+                made while another thread is using the port.
+ Input:         Port
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_PortWake( PSERIAL_PORT *Port )
+{
+#ifdef _WIN32
+  if ( Port->WakeEvent != NULL )
+  {
+    SetEvent( Port->WakeEvent );
+  }
+#else
+  char Byte = 0;
+  ssize_t Written;
+  if ( Port->WakePipe[1] >= 0 )
+  {
+    // Fails only when the pipe is full, which already holds a wake
+    Written = write( Port->WakePipe[1], &Byte, 1 );
+    (void)Written;
+  }
+#endif
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_PortWriteRaw ID:1
+ Purpose:       Writes unframed bytes in one call
+ Input:         Port, Bytes, Count
+ Output:        Number of bytes written
+ Errors:        None
+------------------------------------------------------------------------*/
+unsigned long PSERIAL_PortWriteRaw( PSERIAL_PORT *Port,
+                                    const unsigned char *Bytes,
+                                    unsigned long Count )
+{
+#ifdef _WIN32
+  // The handle is overlapped, so wait here for the write to finish
+  OVERLAPPED Overlapped;
+  ZeroMemory( &Overlapped, sizeof(Overlapped) );
+  Overlapped.hEvent = Port->WriteEvent;
+  Port->BytesWritten = 0;
+  if ( !WriteFile( Port->PortHandle,
+                   Bytes,
+                   Count,
+                   &Port->BytesWritten,
+                   &Overlapped )
+       && ( GetLastError() != ERROR_IO_PENDING
+            || !GetOverlappedResult( Port->PortHandle, &Overlapped, &Port->BytesWritten, TRUE ) ) )
+  {
+    Port->BytesWritten = 0;
+  }
+#else
+  ssize_t Written = write( Port->PortHandle, Bytes, Count );
+  Port->BytesWritten = Written > 0 ? (unsigned long)Written : 0;
+#endif
+  PCAPTURE_Record( Port->Capture, PCAPTURE_TX, Bytes, Port->BytesWritten );
+  return Port->BytesWritten;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_Initialize ID:1
+ Purpose:       Initializes the serial communication API Must be
+                called before using any other functions in the API
+ Input:         None
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_Initialize ( void )
+{
+  PSERIAL_PortInit( &DefaultPort, 254 );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_SetUnits ID:1
+ Purpose:       PSERIAL_PortSetUnits on the default port
+ Input:         Units
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_SetUnits( unsigned char Units )
+{
+  PSERIAL_PortSetUnits( &DefaultPort, Units );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_SetCapture ID:1
+ Purpose:       PSERIAL_PortSetCapture on the default port
+ Input:         Capture (NULL stops recording)
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_SetCapture( PCAPTURE *Capture )
+{
+  PSERIAL_PortSetCapture( &DefaultPort, Capture );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_Open ID:1
+ Purpose:       PSERIAL_PortOpen on the default port
+ Input:         PortName
+ Output:        TRUE on success, FALSE on failure
+ Errors:        See PSERIAL_PortOpen
+------------------------------------------------------------------------*/
+int PSERIAL_Open ( const char *PortName )
+{
+  return PSERIAL_PortOpen( &DefaultPort, PortName );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_Close ID:1
+ Purpose:       Closes the default serial communication port
  Input:         None
  Output:        None
  Errors:        None
 ------------------------------------------------------------------------*/
 void PSERIAL_Close ( void )
 {
-  if ( INVALID_HANDLE_VALUE != PortHandle )
-	{
-	  CloseHandle(PortHandle);
-    PortHandle = INVALID_HANDLE_VALUE;
-	}
+  PSERIAL_PortClose( &DefaultPort );
 }
 
 
 /*------------------------------------------------------------------------
  Procedure:     PSERIAL_Receive ID:1
- Purpose:       Polls the receive buffer to see if any byte has
+ Purpose:       Polls the receive buffer to see if a packet has
                 arrived.  When 6 bytes are read, it returns TRUE and
                 the user can read the Unit, Command and Data.
-                Should be called frequently (i.e. polled mode)
+                Should be called frequently (i.e. polled mode), or use
+                PSERIAL_ReceiveWait to block instead.
  Input:         None
  Output:        Returns TRUE if a 6-byte packet is ready
                 Returns FALSE if a 6-byte packet is not ready
@@ -154,48 +832,58 @@ int PSERIAL_Receive( unsigned char *Unit,
                      unsigned char *Command,
                      long *Data )
 {
-  unsigned char TempByte;
-  if ( timeGetTime() - RxTimeStamp > RXTIMEOUT )
-  {
-    RxCount = 0;
-    RxTimeStamp = timeGetTime();
-  }
-  ReadFile( PortHandle,
-            &TempByte,     // Where to put the byte read
-            1,             // read one byte at a time
-            &BytesRead,    // Bytes actually read
-            NULL );
-  if ( BytesRead > 0 ) // A byte is read
-  {
-    RxBuffer[RxCount] = TempByte; // Store the byte
-    RxCount++;                    // Increment counter
-    RxTimeStamp = timeGetTime();  // reload timestamp
-  }
-  if ( PSERIAL_PACKETSIZE == RxCount ) // A full buffer
-  {
-    // A packet is ready to be used
-    *Unit    = RxBuffer[0];
-    *Command = RxBuffer[1];
-    // Position 2 is LSB; Position 5 is MSB
-    *Data  = ((RxBuffer[2]      ) & 0x000000FF)
-	         + ((RxBuffer[3] <<  8) & 0x0000FF00)
-           + ((RxBuffer[4] << 16) & 0x00FF0000)
-           + ((RxBuffer[5] << 24) & 0xFF000000);
-    // reset the byte counter to receive new packet
-    RxCount = 0;
-    return TRUE;
-  }
-  else
+  return PSERIAL_ReceiveWait( Unit, Command, Data, 0 );
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_ReceiveWait ID:1
+ Purpose:       Blocks until a complete 6-byte packet has arrived on
+                the default port or TimeoutMs has elapsed.  The thread
+                sleeps in the driver (poll on POSIX, comm timeouts on
+                Win32) instead of spinning.
+ Input:         TimeoutMs
+ Output:        Returns TRUE if a 6-byte packet is ready
+                Returns FALSE if the deadline passed first
+                Also returns Unit, Command, Data
+ Errors:        None
+------------------------------------------------------------------------*/
+int PSERIAL_ReceiveWait( unsigned char *Unit,
+                         unsigned char *Command,
+                         long *Data,
+                         unsigned long TimeoutMs )
+{
+  PSERIAL_PACKET Packet;
+
+  if ( PSERIAL_PortReceiveMany( &DefaultPort, &Packet, 1, TimeoutMs ) == 0 )
   {
-    // Did not receive a full packet yet.
     return FALSE;
   }
+  *Unit    = Packet.Unit;
+  *Command = Packet.Command;
+  *Data    = Packet.Data;
+  return TRUE;
+}
+
+
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_ReceiveMany ID:1
+ Purpose:       PSERIAL_PortReceiveMany on the default port
+ Input:         MaxPackets, TimeoutMs
+ Output:        Number of packets written to Packets
+ Errors:        None
+------------------------------------------------------------------------*/
+int PSERIAL_ReceiveMany( PSERIAL_PACKET *Packets,
+                         int MaxPackets,
+                         unsigned long TimeoutMs )
+{
+  return PSERIAL_PortReceiveMany( &DefaultPort, Packets, MaxPackets, TimeoutMs );
 }
 
 
 /*------------------------------------------------------------------------
  Procedure:     PSERIAL_Send ID:1
- Purpose:       Write a packet to the serial port
+ Purpose:       Write a packet to the default serial port
  Input:         Unit
                 Command
                 Data
@@ -206,19 +894,18 @@ void PSERIAL_Send( unsigned char Unit,
                    unsigned char Command,
                    long Data )
 {
-  TxBuffer[0] = Unit;
-  TxBuffer[1] = Command;
-  // Position 2 is LSB; Position 5 is MSB
-  TxBuffer[2] = (Data & 0x000000FF);
-  TxBuffer[3] = ((Data >> 8) & 0x000000FF);
-  TxBuffer[4] = ((Data >> 16) & 0x000000FF);
-  TxBuffer[5] = ((Data >> 24) & 0x000000FF);
-
-  WriteFile( PortHandle,
-             TxBuffer,
-             PSERIAL_PACKETSIZE,
-             &BytesWritten,
-             NULL );
+  PSERIAL_PortSend( &DefaultPort, Unit, Command, Data );
 }
 
 
+/*------------------------------------------------------------------------
+ Procedure:     PSERIAL_SendMany ID:1
+ Purpose:       PSERIAL_PortSendMany on the default port
+ Input:         Packets, Count
+ Output:        None
+ Errors:        None
+------------------------------------------------------------------------*/
+void PSERIAL_SendMany( const PSERIAL_PACKET *Packets, int Count )
+{
+  PSERIAL_PortSendMany( &DefaultPort, Packets, Count );
+}
@@ -6,14 +6,76 @@
  Creation Date: 27 June 2001
  Description:   Serial port API Header for Zaber Techmo units.
                 Language : C
-								Platform : Win32
-                Serial   : Polled mode operation
+								Platform : Win32, POSIX (termios)
+                Serial   : Polled mode operation, or blocking with
+                           a deadline through PSERIAL_ReceiveWait
 ------------------------------------------------------------------------*/
 
 #ifndef _PSERIAL_H_
 #define _PSERIAL_H_
 
+#include "pcapture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define PSERIAL_PACKETSIZE 6
+#define PSERIAL_MAXBATCH   16 // Packets coalesced into one write
+
+typedef struct
+{
+  unsigned char Unit;    // Device number in the daisy chain
+  unsigned char Command; // Zaber command (or reply) number
+  long Data;             // Signed 32-bit payload
+} PSERIAL_PACKET;
+
+// Independent serial port with its own handle and receive state
+typedef struct PSERIAL_PORT PSERIAL_PORT;
+
+extern PSERIAL_PORT *PSERIAL_PortCreate( unsigned char Units );
+
+extern void PSERIAL_PortDestroy( PSERIAL_PORT *Port );
+
+extern void PSERIAL_PortSetUnits( PSERIAL_PORT *Port, unsigned char Units );
+
+extern void PSERIAL_PortSetCapture( PSERIAL_PORT *Port, PCAPTURE *Capture );
+
+extern int PSERIAL_PortIsOpen( const PSERIAL_PORT *Port );
+
+extern int PSERIAL_PortOpen( PSERIAL_PORT *Port, const char *PortName );
+
+extern int PSERIAL_PortOpenBaud( PSERIAL_PORT *Port,
+                                const char *PortName,
+                                unsigned long Baud );
+
+extern void PSERIAL_PortClose( PSERIAL_PORT *Port );
+
+extern int PSERIAL_PortReceiveMany( PSERIAL_PORT *Port,
+                                   PSERIAL_PACKET *Packets,
+                                   int MaxPackets,
+                                   unsigned long TimeoutMs );
+
+extern void PSERIAL_PortSend( PSERIAL_PORT *Port,
+                             unsigned char Unit,
+                             unsigned char Command,
+                             long Data );
+
+extern void PSERIAL_PortSendMany( PSERIAL_PORT *Port,
+                                 const PSERIAL_PACKET *Packets,
+                                 int Count );
+
+extern unsigned long PSERIAL_PortReadRaw( PSERIAL_PORT *Port,
+                                         unsigned char *Buffer,
+                                         unsigned long MaxBytes,
+                                         unsigned long TimeoutMs );
+
+extern unsigned long PSERIAL_PortWriteRaw( PSERIAL_PORT *Port,
+                                          const unsigned char *Bytes,
+                                          unsigned long Count );
+extern void PSERIAL_PortWake( PSERIAL_PORT *Port );
+
+// Original single-port API, operating on a built-in default port
 
 extern void PSERIAL_Initialize ( void );
 
@@ -25,8 +87,27 @@ extern int PSERIAL_Receive( unsigned char *Unit,
                            unsigned char *Command,
                            long *Data );
 
+extern int PSERIAL_ReceiveWait( unsigned char *Unit,
+                               unsigned char *Command,
+                               long *Data,
+                               unsigned long TimeoutMs );
+
+extern int PSERIAL_ReceiveMany( PSERIAL_PACKET *Packets,
+                               int MaxPackets,
+                               unsigned long TimeoutMs );
+
+extern void PSERIAL_SetUnits( unsigned char Units );
+
+extern void PSERIAL_SetCapture( PCAPTURE *Capture );
+
 extern void PSERIAL_Send( unsigned char Unit,
                              unsigned char Command,
                              long Data );
 
+extern void PSERIAL_SendMany( const PSERIAL_PACKET *Packets, int Count );
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
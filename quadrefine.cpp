@@ -0,0 +1,157 @@
+/*------------------------------------------------------------------------
+ Module:        QUADREFINE.CPP
+ Project:       StepperMotor
+ Description:   Adaptive refinement of the scan grid.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <set>
+
+#include "quadrefine.h"
+
+using namespace std;
+
+QuadRefiner::QuadRefiner(int columns, int rows, int levels, double vminThreshold, double vavgThreshold)
+	: Columns(columns), Rows(rows), Levels(max(0, min(levels, 16))),
+	  VminThreshold(vminThreshold), VavgThreshold(vavgThreshold)
+{
+	int scale = Scale();
+	for (int c = 0; c + 1 < Columns; c++)
+	{
+		for (int r = 0; r + 1 < Rows; r++)
+		{
+			Leaves.push_back(Cell{c * scale, r * scale, scale});
+		}
+	}
+}
+
+vector<GridPoint> QuadRefiner::Coarse() const
+{
+	vector<GridPoint> points;
+	for (int c = 0; c < Columns; c++)
+	{
+		for (int r = 0; r < Rows; r++)
+		{
+			points.push_back(GridPoint{c * Scale(), r * Scale()});
+		}
+	}
+	return points;
+}
+
+void QuadRefiner::Record(const GridPoint& point, double vmin, double vavg)
+{
+	Readings[make_pair(point.Column, point.Row)] = Reading{vmin, vavg};
+}
+
+double QuadRefiner::Spread(const Cell& cell) const
+{
+	// Corners, plus edge midpoints where a neighbouring cell's split has
+	// already measured them
+	int half = cell.Size / 2;
+	const int offsets[8][2] = {{0, 0}, {2, 0}, {0, 2}, {2, 2}, {1, 0}, {0, 1}, {2, 1}, {1, 2}};
+	double vminLow = 0, vminHigh = 0, vavgLow = 0, vavgHigh = 0;
+	int found = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		auto reading = Readings.find(make_pair(cell.Column + offsets[i][0] * half, cell.Row + offsets[i][1] * half));
+		if (reading == Readings.end())
+		{
+			if (i < 4)
+			{
+				return 0.0; // corners not all measured yet
+			}
+			continue;
+		}
+		const Reading& value = reading->second;
+		if (found++ == 0)
+		{
+			vminLow = vminHigh = value.Vmin;
+			vavgLow = vavgHigh = value.Vavg;
+		}
+		vminLow = min(vminLow, value.Vmin);
+		vminHigh = max(vminHigh, value.Vmin);
+		vavgLow = min(vavgLow, value.Vavg);
+		vavgHigh = max(vavgHigh, value.Vavg);
+	}
+	double spread = 0.0;
+	if (VminThreshold > 0)
+	{
+		spread = max(spread, (vminHigh - vminLow) / VminThreshold);
+	}
+	if (VavgThreshold > 0)
+	{
+		spread = max(spread, (vavgHigh - vavgLow) / VavgThreshold);
+	}
+	return spread;
+}
+
+vector<GridPoint> QuadRefiner::Refine(size_t maxPoints)
+{
+	// Splittable cells, most different first
+	vector<pair<double, size_t>> candidates;
+	for (size_t i = 0; i < Leaves.size(); i++)
+	{
+		if (Leaves[i].Size < 2)
+		{
+			continue;
+		}
+		double spread = Spread(Leaves[i]);
+		if (spread > 1.0)
+		{
+			candidates.push_back(make_pair(spread, i));
+		}
+	}
+	sort(candidates.begin(), candidates.end(), [](const pair<double, size_t>& a, const pair<double, size_t>& b)
+	{
+		return a.first > b.first;
+	});
+
+	vector<GridPoint> points;
+	set<pair<int, int>> queued;
+	vector<bool> split(Leaves.size(), false);
+	for (const auto& candidate : candidates)
+	{
+		const Cell& cell = Leaves[candidate.second];
+		int half = cell.Size / 2;
+		vector<pair<int, int>> added;
+		const int offsets[5][2] = {{1, 0}, {0, 1}, {1, 1}, {2, 1}, {1, 2}};
+		for (int i = 0; i < 5; i++)
+		{
+			pair<int, int> point(cell.Column + offsets[i][0] * half, cell.Row + offsets[i][1] * half);
+			if (!Readings.count(point) && !queued.count(point))
+			{
+				added.push_back(point);
+			}
+		}
+		if (points.size() + added.size() > maxPoints)
+		{
+			break;
+		}
+		for (const auto& point : added)
+		{
+			queued.insert(point);
+			points.push_back(GridPoint{point.first, point.second});
+		}
+		split[candidate.second] = true;
+	}
+
+	// Quarter the cells that were split
+	vector<Cell> leaves;
+	for (size_t i = 0; i < Leaves.size(); i++)
+	{
+		const Cell& cell = Leaves[i];
+		if (!split[i])
+		{
+			leaves.push_back(cell);
+			continue;
+		}
+		int half = cell.Size / 2;
+		leaves.push_back(Cell{cell.Column, cell.Row, half});
+		leaves.push_back(Cell{cell.Column + half, cell.Row, half});
+		leaves.push_back(Cell{cell.Column, cell.Row + half, half});
+		leaves.push_back(Cell{cell.Column + half, cell.Row + half, half});
+	}
+	Leaves.swap(leaves);
+	return points;
+}
@@ -0,0 +1,72 @@
+/*------------------------------------------------------------------------
+ Module:        QUADREFINE.H
+ Project:       StepperMotor
+ Description:   Adaptive refinement of the scan grid.  The coarse grid
+                is split into cells; a cell whose measured points differ
+                by more than a threshold is quartered, adding its edge
+                midpoints and centre, until the cells reach the finest
+                level or the point budget runs out.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _QUADREFINE_H_
+#define _QUADREFINE_H_
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "scanorder.h"
+
+// Points are on a lattice Scale() times finer than the coarse grid, so
+// coarse point (c, r) is lattice point (c * Scale(), r * Scale()).
+class QuadRefiner
+{
+public:
+	// levels is how many times a coarse cell may be halved.  A cell is
+	// split when the VMIN (or VAVG) readings on its corners and edges
+	// span more than the threshold; a threshold of 0 ignores that reading.
+	QuadRefiner(int columns, int rows, int levels, double vminThreshold, double vavgThreshold);
+
+	int Scale() const { return 1 << Levels; }
+
+	// Every coarse grid point, in lattice coordinates
+	std::vector<GridPoint> Coarse() const;
+
+	void Record(const GridPoint& point, double vmin, double vavg);
+
+	// Points to measure next: the cells that differ most are split
+	// first, and no more than maxPoints are returned.  Empty once no
+	// cell needs splitting or the budget allows no further split.
+	std::vector<GridPoint> Refine(size_t maxPoints);
+
+	size_t Measured() const { return Readings.size(); }
+
+private:
+	struct Cell
+	{
+		int Column; // lower corner, lattice coordinates
+		int Row;
+		int Size;
+	};
+
+	struct Reading
+	{
+		double Vmin;
+		double Vavg;
+	};
+
+	// How far past its thresholds a cell's readings spread; above 1
+	// means split
+	double Spread(const Cell& cell) const;
+
+	int Columns;
+	int Rows;
+	int Levels;
+	double VminThreshold;
+	double VavgThreshold;
+	std::vector<Cell> Leaves;
+	std::map<std::pair<int, int>, Reading> Readings;
+};
+
+#endif
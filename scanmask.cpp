@@ -0,0 +1,132 @@
+/*------------------------------------------------------------------------
+ Module:        SCANMASK.CPP
+ Project:       StepperMotor
+ Description:   Region-of-interest mask for the scan.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "scanmask.h"
+
+using namespace std;
+
+#define EDGE_CM 1e-6 // points this close to a polygon edge are inside
+
+ScanMask ScanMask::Load(const string& fileName)
+{
+	ifstream stream(fileName);
+	if (!stream)
+	{
+		throw runtime_error("Unable to open mask file " + fileName);
+	}
+	ScanMask mask;
+	bool bitmap = false;
+	string line;
+	int lineNumber = 0;
+	while (getline(stream, line))
+	{
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		string first;
+		if (!(fields >> first))
+		{
+			continue; // blank or comment
+		}
+		string where = fileName + ":" + to_string(lineNumber) + ": ";
+		string rest;
+		if (first == "polygon")
+		{
+			if (bitmap)
+			{
+				throw runtime_error(where + "a mask is either polygons or a bitmap");
+			}
+			mask.Polygons.emplace_back();
+		}
+		else if (first == "bitmap")
+		{
+			if (bitmap || !mask.Polygons.empty())
+			{
+				throw runtime_error(where + "a mask is either polygons or one bitmap");
+			}
+			if (!(fields >> mask.BitmapOrigin.X >> mask.BitmapOrigin.Y >> mask.CellCm) || mask.CellCm <= 0
+				|| (fields >> rest))
+			{
+				throw runtime_error(where + "expected \"bitmap xCm yCm cellCm\"");
+			}
+			bitmap = true;
+		}
+		else if (bitmap)
+		{
+			if (first.find_first_not_of("01") != string::npos || (fields >> rest))
+			{
+				throw runtime_error(where + "bitmap rows are 0s and 1s");
+			}
+			mask.Bitmap.push_back(first);
+		}
+		else
+		{
+			StagePoint vertex;
+			istringstream point(line);
+			if (mask.Polygons.empty() || !(point >> vertex.X >> vertex.Y) || (point >> rest))
+			{
+				throw runtime_error(where + "expected \"polygon\" then \"x y\" vertices");
+			}
+			mask.Polygons.back().push_back(vertex);
+		}
+	}
+	for (const vector<StagePoint>& polygon : mask.Polygons)
+	{
+		if (polygon.size() < 3)
+		{
+			throw runtime_error("Mask file " + fileName + " has a polygon with fewer than 3 vertices");
+		}
+	}
+	if (mask.Polygons.empty() && mask.Bitmap.empty())
+	{
+		throw runtime_error("Mask file " + fileName + " has no polygon or bitmap");
+	}
+	return mask;
+}
+
+bool ScanMask::Contains(double xCm, double yCm) const
+{
+	if (!Bitmap.empty())
+	{
+		long column = lround(floor((xCm - BitmapOrigin.X) / CellCm));
+		long row = lround(floor((yCm - BitmapOrigin.Y) / CellCm));
+		return row >= 0 && row < (long)Bitmap.size() && column >= 0
+			&& column < (long)Bitmap[row].size() && Bitmap[row][column] == '1';
+	}
+	for (const vector<StagePoint>& polygon : Polygons)
+	{
+		// Even-odd crossing test, with points on an edge counted inside
+		bool inside = false;
+		for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++)
+		{
+			const StagePoint& a = polygon[i];
+			const StagePoint& b = polygon[j];
+			double cross = (b.X - a.X) * (yCm - a.Y) - (b.Y - a.Y) * (xCm - a.X);
+			double length = hypot(b.X - a.X, b.Y - a.Y);
+			if (fabs(cross) <= EDGE_CM * max(length, 1.0)
+				&& xCm >= min(a.X, b.X) - EDGE_CM && xCm <= max(a.X, b.X) + EDGE_CM
+				&& yCm >= min(a.Y, b.Y) - EDGE_CM && yCm <= max(a.Y, b.Y) + EDGE_CM)
+			{
+				return true;
+			}
+			if ((a.Y > yCm) != (b.Y > yCm) && xCm < (b.X - a.X) * (yCm - a.Y) / (b.Y - a.Y) + a.X)
+			{
+				inside = !inside;
+			}
+		}
+		if (inside)
+		{
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,45 @@
+/*------------------------------------------------------------------------
+ Module:        SCANMASK.H
+ Project:       StepperMotor
+ Description:   Region-of-interest mask for the scan.  Points outside
+                the tile footprint, given as polygons or a bitmap in cm
+                in the same frame as xOriginCm/yOriginCm, are dropped
+                from the plan.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SCANMASK_H_
+#define _SCANMASK_H_
+
+#include <string>
+#include <vector>
+
+#include "scanorder.h"
+
+// Mask file, '#' starts a comment:
+//
+//   polygon            one or more polygons, each a list of "xCm yCm"
+//   0 0                vertices; a point inside any of them is kept
+//   10 0
+//   10 5
+//
+//   bitmap 0 0 0.5     or one bitmap: origin xCm yCm and cell size cm,
+//   0110               then rows of 0/1 from the origin row upwards, a
+//   1111               column per character along X
+class ScanMask
+{
+public:
+	// Throws runtime_error naming the file and line on a bad mask
+	static ScanMask Load(const std::string& fileName);
+
+	// True for points inside the footprint, on its edges included
+	bool Contains(double xCm, double yCm) const;
+
+private:
+	std::vector<std::vector<StagePoint>> Polygons;
+	std::vector<std::string> Bitmap; // rows of '0'/'1'
+	StagePoint BitmapOrigin = {0.0, 0.0};
+	double CellCm = 0.0;
+};
+
+#endif
@@ -0,0 +1,229 @@
+/*------------------------------------------------------------------------
+ Module:        SCANORDER.CPP
+ Project:       StepperMotor
+ Description:   Visiting orders for the nX by nY scan grid.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "scanorder.h"
+
+using namespace std;
+
+vector<GridPoint> RasterOrder(int columns, int rows)
+{
+	vector<GridPoint> order;
+	order.reserve((size_t)columns * rows);
+	for (int i = 0; i < columns; i++)
+	{
+		for (int j = 0; j < rows; j++)
+		{
+			order.push_back(GridPoint{i, j});
+		}
+	}
+	return order;
+}
+
+vector<GridPoint> SerpentineOrder(int columns, int rows)
+{
+	vector<GridPoint> order;
+	order.reserve((size_t)columns * rows);
+	for (int i = 0; i < columns; i++)
+	{
+		for (int k = 0; k < rows; k++)
+		{
+			order.push_back(GridPoint{i, i % 2 == 0 ? k : rows - 1 - k});
+		}
+	}
+	return order;
+}
+
+vector<GridPoint> RowSerpentineOrder(int columns, int rows)
+{
+	vector<GridPoint> order;
+	order.reserve((size_t)columns * rows);
+	for (int k = 0; k < rows; k++)
+	{
+		for (int i = 0; i < columns; i++)
+		{
+			order.push_back(GridPoint{k % 2 == 0 ? i : columns - 1 - i, k});
+		}
+	}
+	return order;
+}
+
+vector<GridPoint> SpiralOrder(int columns, int rows)
+{
+	vector<GridPoint> order;
+	order.reserve((size_t)columns * rows);
+	int left = 0, right = columns - 1, bottom = 0, top = rows - 1;
+	while (left <= right && bottom <= top)
+	{
+		for (int j = bottom; j <= top; j++)
+		{
+			order.push_back(GridPoint{left, j});
+		}
+		for (int i = left + 1; i <= right; i++)
+		{
+			order.push_back(GridPoint{i, top});
+		}
+		if (left < right)
+		{
+			for (int j = top - 1; j >= bottom; j--)
+			{
+				order.push_back(GridPoint{right, j});
+			}
+		}
+		if (bottom < top)
+		{
+			for (int i = right - 1; i > left; i--)
+			{
+				order.push_back(GridPoint{i, bottom});
+			}
+		}
+		left++;
+		right--;
+		bottom++;
+		top--;
+	}
+	return order;
+}
+
+// Distance d along a Hilbert curve filling an n x n square (n a power
+// of two) to cell coordinates
+static GridPoint HilbertCell(int n, long d)
+{
+	int x = 0, y = 0;
+	for (int s = 1; s < n; s *= 2)
+	{
+		int rx = 1 & (int)(d / 2);
+		int ry = 1 & (int)(d ^ rx);
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			int t = x;
+			x = y;
+			y = t;
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+	return GridPoint{x, y};
+}
+
+vector<GridPoint> HilbertOrder(int columns, int rows)
+{
+	vector<GridPoint> order;
+	order.reserve((size_t)columns * rows);
+	int n = 1;
+	while (n < columns || n < rows)
+	{
+		n *= 2;
+	}
+	for (long d = 0; d < (long)n * n; d++)
+	{
+		GridPoint cell = HilbertCell(n, d);
+		if (cell.Column < columns && cell.Row < rows)
+		{
+			order.push_back(cell);
+		}
+	}
+	return order;
+}
+
+ScanOrderFn ScanOrderByName(const string& name)
+{
+	if (name == "raster") return RasterOrder;
+	if (name == "serpentine") return SerpentineOrder;
+	if (name == "rows") return RowSerpentineOrder;
+	if (name == "spiral") return SpiralOrder;
+	if (name == "hilbert") return HilbertOrder;
+	return nullptr;
+}
+
+vector<GridPoint> ReadScanOrder(const string& fileName, int columns, int rows)
+{
+	ifstream stream(fileName);
+	if (!stream)
+	{
+		throw runtime_error("Unable to open scan order file " + fileName);
+	}
+	vector<GridPoint> order;
+	vector<bool> seen((size_t)columns * rows, false);
+	string line;
+	int lineNumber = 0;
+	while (getline(stream, line))
+	{
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		GridPoint point;
+		if (!(fields >> point.Column))
+		{
+			continue; // blank or comment
+		}
+		string rest;
+		if (!(fields >> point.Row) || (fields >> rest))
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": expected \"column row\"");
+		}
+		if (point.Column < 0 || point.Column >= columns || point.Row < 0 || point.Row >= rows)
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": point is outside the grid");
+		}
+		size_t index = (size_t)point.Column * rows + point.Row;
+		if (seen[index])
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": point is already in the order");
+		}
+		seen[index] = true;
+		order.push_back(point);
+	}
+	if (order.empty())
+	{
+		throw runtime_error("Scan order file " + fileName + " has no points");
+	}
+	return order;
+}
+
+vector<StagePoint> ReadScanPoints(const string& fileName)
+{
+	ifstream stream(fileName);
+	if (!stream)
+	{
+		throw runtime_error("Unable to open points file " + fileName);
+	}
+	vector<StagePoint> points;
+	string line;
+	int lineNumber = 0;
+	while (getline(stream, line))
+	{
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		StagePoint point;
+		if (!(fields >> point.X))
+		{
+			continue; // blank or comment
+		}
+		string rest;
+		if (!(fields >> point.Y) || (fields >> rest))
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": expected \"x y\"");
+		}
+		points.push_back(point);
+	}
+	if (points.empty())
+	{
+		throw runtime_error("Points file " + fileName + " has no points");
+	}
+	return points;
+}
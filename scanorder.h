@@ -0,0 +1,60 @@
+/*------------------------------------------------------------------------
+ Module:        SCANORDER.H
+ Project:       StepperMotor
+ Description:   Visiting orders for the nX by nY scan grid.  Each
+                strategy returns every grid point once, as (column, row)
+                indices into xvals and yvals.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SCANORDER_H_
+#define _SCANORDER_H_
+
+#include <string>
+#include <vector>
+
+struct GridPoint
+{
+	int Column; // index into xvals
+	int Row;    // index into yvals
+};
+
+// Stage coordinates, in microsteps unless stated otherwise
+struct StagePoint
+{
+	double X;
+	double Y;
+};
+
+typedef std::vector<GridPoint> (*ScanOrderFn)(int columns, int rows);
+
+// Column by column, each starting again from row 0 (the original scan)
+std::vector<GridPoint> RasterOrder(int columns, int rows);
+
+// Column by column, alternating direction so Y never flies back
+std::vector<GridPoint> SerpentineOrder(int columns, int rows);
+
+// Row by row, alternating direction so X never flies back (fly scans
+// sweep X along each row)
+std::vector<GridPoint> RowSerpentineOrder(int columns, int rows);
+
+// Around the grid edge from (0, 0), then inwards ring by ring
+std::vector<GridPoint> SpiralOrder(int columns, int rows);
+
+// Hilbert curve over the smallest covering power-of-two square,
+// keeping the points that fall inside the grid
+std::vector<GridPoint> HilbertOrder(int columns, int rows);
+
+// "raster", "serpentine", "rows", "spiral" or "hilbert"; nullptr if unknown
+ScanOrderFn ScanOrderByName(const std::string& name);
+
+// One "column row" pair per line, '#' starts a comment.  Points may be
+// a subset of the grid but not repeat.  Throws runtime_error naming the
+// offending line.
+std::vector<GridPoint> ReadScanOrder(const std::string& fileName, int columns, int rows);
+
+// One "x y" pair per line in the file's own units, '#' starts a
+// comment.  Throws runtime_error naming the offending line.
+std::vector<StagePoint> ReadScanPoints(const std::string& fileName);
+
+#endif
@@ -0,0 +1,144 @@
+/*------------------------------------------------------------------------
+ Module:        SCANPLAN.CPP
+ Project:       StepperMotor
+ Description:   A scan compiled once before the run.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "scanplan.h"
+
+using namespace std;
+
+#define PLAN_HEADER "# ScanPlan 2: x y dx dy predictedMs timeoutMs remainingMs" \
+	" xVelocity xAccel xEased yVelocity yAccel yEased label"
+
+ScanPlan ScanPlan::Compile(const vector<StagePoint>& targets, const vector<string>& labels,
+	const StagePoint& start, const MotionModel& motion, long xLimit, long yLimit, bool profiled)
+{
+	ScanPlan plan;
+	plan.XLimit = xLimit;
+	plan.YLimit = yLimit;
+	plan.Profiled = profiled;
+	plan.Plan.reserve(targets.size());
+	long xFrom = lround(start.X), yFrom = lround(start.Y);
+	for (size_t k = 0; k < targets.size(); k++)
+	{
+		PlannedPoint point;
+		point.X = lround(targets[k].X);
+		point.Y = lround(targets[k].Y);
+		if (point.X <= 0 || point.X >= xLimit || point.Y <= 0 || point.Y >= yLimit)
+		{
+			throw out_of_range("Scan point " + labels[k] + " is beyond the end of the drive");
+		}
+		point.Dx = labs(point.X - xFrom);
+		point.Dy = labs(point.Y - yFrom);
+		point.Label = labels[k];
+		plan.Plan.push_back(point);
+		xFrom = point.X;
+		yFrom = point.Y;
+	}
+	plan.Retime(0, motion);
+	return plan;
+}
+
+void ScanPlan::Retime(size_t from, const MotionModel& motion)
+{
+	for (size_t k = from; k < Plan.size(); k++)
+	{
+		PlannedPoint& point = Plan[k];
+		double dx = k == 0 ? (double)XLimit : (double)point.Dx;
+		double dy = k == 0 ? (double)YLimit : (double)point.Dy;
+		point.PredictedMs = (unsigned long)lround(1000.0 * motion.MoveSeconds(point.Dx, point.Dy));
+		point.TimeoutMs = motion.TimeoutMs(dx, dy);
+		point.Profile = MoveProfile{{0.0, 0.0}, {0.0, 0.0}, {false, false}};
+		if (Profiled && k == 0)
+		{
+			for (int axis = 0; axis < 2; axis++)
+			{
+				point.Profile.Velocity[axis] = motion.Fastest(axis).Velocity;
+				point.Profile.Accel[axis] = motion.Fastest(axis).Accel;
+			}
+		}
+		else if (Profiled)
+		{
+			point.Profile = motion.Profile(point.Dx, point.Dy);
+		}
+	}
+	unsigned long remaining = 0;
+	for (size_t k = Plan.size(); k-- > 0; )
+	{
+		remaining += Plan[k].PredictedMs;
+		Plan[k].RemainingMs = remaining;
+	}
+}
+
+bool ScanPlan::Save(const string& fileName) const
+{
+	ofstream stream(fileName);
+	if (!stream)
+	{
+		return false;
+	}
+	stream << PLAN_HEADER << endl;
+	stream.precision(numeric_limits<double>::max_digits10);
+	for (const PlannedPoint& point : Plan)
+	{
+		stream << point.X << " " << point.Y << " " << point.Dx << " " << point.Dy << " "
+			<< point.PredictedMs << " " << point.TimeoutMs << " " << point.RemainingMs;
+		for (int axis = 0; axis < 2; axis++)
+		{
+			stream << " " << point.Profile.Velocity[axis] << " " << point.Profile.Accel[axis]
+				<< " " << (point.Profile.Eased[axis] ? 1 : 0);
+		}
+		stream << " " << point.Label << endl;
+	}
+	return (bool)stream;
+}
+
+ScanPlan ScanPlan::Load(const string& fileName, long xLimit, long yLimit)
+{
+	ifstream stream(fileName);
+	string line;
+	if (!getline(stream, line) || line != PLAN_HEADER)
+	{
+		throw runtime_error(fileName + " is not a scan plan");
+	}
+	ScanPlan plan;
+	plan.XLimit = xLimit;
+	plan.YLimit = yLimit;
+	int lineNumber = 1;
+	while (getline(stream, line))
+	{
+		lineNumber++;
+		istringstream fields(line);
+		PlannedPoint point;
+		if (!(fields >> point.X >> point.Y >> point.Dx >> point.Dy >> point.PredictedMs
+			>> point.TimeoutMs >> point.RemainingMs))
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": malformed plan point");
+		}
+		for (int axis = 0; axis < 2; axis++)
+		{
+			int eased = 0;
+			fields >> point.Profile.Velocity[axis] >> point.Profile.Accel[axis] >> eased;
+			point.Profile.Eased[axis] = eased != 0;
+		}
+		if (!(fields >> point.Label))
+		{
+			throw runtime_error(fileName + ":" + to_string(lineNumber) + ": malformed plan point");
+		}
+		if (point.X <= 0 || point.X >= xLimit || point.Y <= 0 || point.Y >= yLimit)
+		{
+			throw out_of_range("Scan point " + point.Label + " is beyond the end of the drive");
+		}
+		plan.Profiled = plan.Profiled || point.Profile.Velocity[0] > 0 || point.Profile.Velocity[1] > 0;
+		plan.Plan.push_back(point);
+	}
+	return plan;
+}
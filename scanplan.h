@@ -0,0 +1,79 @@
+/*------------------------------------------------------------------------
+ Module:        SCANPLAN.H
+ Project:       StepperMotor
+ Description:   A scan compiled once before the run: targets in integer
+                microsteps in visiting order, each with its predicted
+                move time, wait bound and drive settings, and the
+                remaining stage travel for the ETA.  The run loop reads
+                its moves from here; only the timing is redone, when the
+                motion model is refitted.  Saved alongside the scan
+                output.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SCANPLAN_H_
+#define _SCANPLAN_H_
+
+#include <string>
+#include <vector>
+
+#include "motionmodel.h"
+#include "scanorder.h"
+
+struct PlannedPoint
+{
+	long X;                      // microsteps
+	long Y;
+	long Dx;                     // travel from the previous point
+	long Dy;
+	unsigned long PredictedMs;   // modelled move time
+	unsigned long TimeoutMs;     // wait bound for the move-complete replies
+	unsigned long RemainingMs;   // modelled travel from here to the end
+	MoveProfile Profile;         // drive settings for the move, or zero velocities
+	std::string Label;           // written to the _POSITIONS file
+};
+
+// Targets, order and labels are fixed once compiled or loaded; a
+// default-constructed plan is empty
+class ScanPlan
+{
+public:
+	ScanPlan() : XLimit(0), YLimit(0), Profiled(false) {}
+
+	// Targets are visited in the given order, starting from start.  The
+	// first move's distance is unknown until the stages report, so it is
+	// bounded by a full-travel move.  Throws out_of_range if a target is
+	// not strictly inside (0, xLimit) x (0, yLimit).  With profiled set,
+	// every move carries speed and acceleration from the motion model;
+	// the first, whose length is not known, runs both axes at the limits.
+	static ScanPlan Compile(const std::vector<StagePoint>& targets, const std::vector<std::string>& labels,
+		const StagePoint& start, const MotionModel& motion, long xLimit, long yLimit, bool profiled = false);
+
+	// Text, one point per line, doubles written in full so a saved plan
+	// loads back identically.  Load throws runtime_error on a malformed
+	// file and out_of_range, as Compile does, on a target outside the
+	// drives.  A loaded plan is profiled if any of its moves carries
+	// drive settings.
+	bool Save(const std::string& fileName) const;
+	static ScanPlan Load(const std::string& fileName, long xLimit, long yLimit);
+
+	// Predictions, wait bounds and (for a profiled plan) drive settings
+	// of the points from index on, redone from a refitted model, and
+	// the remaining travel of every point with them
+	void Retime(size_t from, const MotionModel& motion);
+
+	const std::vector<PlannedPoint>& Points() const { return Plan; }
+	size_t Size() const { return Plan.size(); }
+	const PlannedPoint& operator[](size_t index) const { return Plan[index]; }
+
+	unsigned long EtaMs() const { return Plan.empty() ? 0 : Plan.front().RemainingMs; }
+	bool IsProfiled() const { return Profiled; }
+
+private:
+	std::vector<PlannedPoint> Plan;
+	long XLimit;   // drive lengths, bounding the first move
+	long YLimit;
+	bool Profiled;
+};
+
+#endif
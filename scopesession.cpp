@@ -0,0 +1,484 @@
+/*------------------------------------------------------------------------
+ Module:        SCOPESESSION.CPP
+ Project:       StepperMotor
+ Description:   One SICL session to the oscilloscope for the whole scan.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "scopesession.h"
+
+using namespace std;
+
+#define REPLY_BYTES 4096
+#define INVALID_VALUE 9.9e37 // the scope's 9.99999E+37 for no result
+#define STB_ESB 0x20         // event status summary, set by *OPC
+#define SRQ_POLL_MS 250
+
+// SRQ handlers are given only the session id
+static mutex SessionsLock;
+static map<INST, ScopeSession*> Sessions;
+
+// Measurements the scope makes on the source channel, with the names
+// they may be given by
+static const char* Quantities[][2] =
+{
+	{"VMIN", "VMIN"}, {"VMAX", "VMAX"}, {"VAVERAGE", "VAVERAGE"}, {"VAVG", "VAVERAGE"},
+	{"VPP", "VPP"}, {"VAMPLITUDE", "VAMPLITUDE"}, {"VTOP", "VTOP"}, {"VBASE", "VBASE"},
+	{"VRMS", "VRMS"}, {"RISETIME", "RISETIME"}, {"FALLTIME", "FALLTIME"}, {"AREA", "AREA"},
+	{"PWIDTH", "PWIDTH"}, {"NWIDTH", "NWIDTH"}, {"FREQUENCY", "FREQUENCY"}, {"PERIOD", "PERIOD"},
+	{"OVERSHOOT", "OVERSHOOT"}, {"PRESHOOT", "PRESHOOT"}
+};
+
+bool MeasurementSet::Add(const string& name)
+{
+	string upper = name;
+	transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+	for (const auto& quantity : Quantities)
+	{
+		if (upper == quantity[0])
+		{
+			if (Index(quantity[1]) < 0)
+			{
+				Text += string(Names.empty() ? "" : ";") + ":MEASURE:" + quantity[1] + "?";
+				Names.push_back(quantity[1]);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+int MeasurementSet::Index(const string& name) const
+{
+	auto found = find(Names.begin(), Names.end(), name);
+	return found == Names.end() ? -1 : (int)(found - Names.begin());
+}
+
+ScopeSession::ScopeSession(const string& address, long timeoutMs)
+	: Name(address), TimeoutMs(timeoutMs), Inst(0), ReconnectCount(0), StateKnown(false), SettingCount(0),
+	  Reply(REPLY_BYTES), Acquiring(false), SrqPending(false), Preamble(), PreambleKnown(false),
+	  PreambleSettings(0), PreambleReconnects(0)
+{
+}
+
+ScopeSession::~ScopeSession()
+{
+	Close();
+}
+
+bool ScopeSession::Open()
+{
+	if (Inst != 0)
+	{
+		return true;
+	}
+	vector<char> address(Name.begin(), Name.end());
+	address.push_back('\0');
+	Inst = iopen(address.data());
+	if (Inst == 0)
+	{
+		return false;
+	}
+	itimeout(Inst, TimeoutMs);
+	{
+		lock_guard<mutex> lock(SessionsLock);
+		Sessions[Inst] = this;
+	}
+	ionsrq(Inst, OnServiceRequest);
+	// Only operation complete sets the event summary, and it requests
+	// service
+	return Send("*ESE 1") && Send("*SRE 32");
+}
+
+void ScopeSession::Close()
+{
+	if (Inst != 0)
+	{
+		ionsrq(Inst, nullptr);
+		{
+			lock_guard<mutex> lock(SessionsLock);
+			Sessions.erase(Inst);
+		}
+		iclose(Inst);
+		Inst = 0;
+	}
+}
+
+void ScopeSession::SetTimeout(long timeoutMs)
+{
+	TimeoutMs = timeoutMs;
+	if (Inst != 0)
+	{
+		itimeout(Inst, TimeoutMs);
+	}
+}
+
+bool ScopeSession::Check()
+{
+	unsigned char status;
+	if (Inst != 0 && ireadstb(Inst, &status) == I_ERR_NOERROR)
+	{
+		return true;
+	}
+	return Recover();
+}
+
+bool ScopeSession::Recover()
+{
+	unsigned char status;
+	if (Inst != 0 && iclear(Inst) == I_ERR_NOERROR && ireadstb(Inst, &status) == I_ERR_NOERROR)
+	{
+		return true;
+	}
+	cout << "Scope session on " << Name << " lost, reopening" << endl;
+	Close();
+	ReconnectCount++;
+	// A scope that stopped answering may have been power cycled
+	StateKnown = false;
+	return Open();
+}
+
+bool ScopeSession::Send(const string& command)
+{
+	vector<char> line(command.begin(), command.end());
+	line.push_back('\n');
+	unsigned long written = 0;
+	return Inst != 0 && iwrite(Inst, line.data(), (unsigned long)line.size(), 1, &written) == I_ERR_NOERROR
+		&& written == line.size();
+}
+
+bool ScopeSession::Write(const string& command)
+{
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if ((Inst != 0 || Open()) && Send(command))
+		{
+			return true;
+		}
+		if (attempt == 0 && !Recover())
+		{
+			break;
+		}
+	}
+	cout << "Scope did not take " << command << endl;
+	return false;
+}
+
+bool ScopeSession::ReadDouble(double* value)
+{
+	char format[] = "%lf%*t";
+	return Inst != 0 && iscanf(Inst, format, value) == 1;
+}
+
+bool ScopeSession::Query(const string& command, double* value)
+{
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (Write(command) && ReadDouble(value))
+		{
+			return true;
+		}
+		if (attempt == 0 && !Recover())
+		{
+			break;
+		}
+	}
+	cout << "No reply from the scope to " << command << endl;
+	return false;
+}
+
+unsigned long ScopeSession::ReadWord(short* buffer, unsigned long bytesToRead)
+{
+	return ReadByte((char*)buffer, bytesToRead);
+}
+
+unsigned long ScopeSession::ReadByte(char* buffer, unsigned long bytesToRead)
+{
+	unsigned long bytesRead = 0;
+	int reason;
+	if (Inst == 0 || iread(Inst, buffer, bytesToRead, &reason, &bytesRead) != I_ERR_NOERROR)
+	{
+		return 0;
+	}
+	return bytesRead;
+}
+
+static string Number(double value)
+{
+	ostringstream text;
+	text << value;
+	return text.str();
+}
+
+bool ScopeSession::Apply(const ScopeState& wanted)
+{
+	bool all = !StateKnown;
+	unsigned long reconnects = ReconnectCount;
+	bool changed = false;
+	bool ok = true;
+	auto send = [&](bool differs, const string& command)
+	{
+		if (all || differs)
+		{
+			changed = true;
+			SettingCount++;
+			ok = Write(command) && ok;
+		}
+	};
+	string channel = ":CHANNEL" + to_string(wanted.Channel);
+	send(wanted.Channel != State.Channel, ":VIEW CHANNEL" + to_string(wanted.Channel));
+	send(wanted.Channel != State.Channel, ":MEASURE:SOURCE CHANNEL" + to_string(wanted.Channel));
+	send(wanted.TimebaseScale != State.TimebaseScale, ":TIMEBASE:SCALE " + Number(wanted.TimebaseScale));
+	send(wanted.TimebasePosition != State.TimebasePosition, ":TIMEBASE:POSITION " + Number(wanted.TimebasePosition));
+	send(wanted.Channel != State.Channel || wanted.ChannelScale != State.ChannelScale,
+		channel + ":SCALE " + Number(wanted.ChannelScale));
+	send(wanted.Channel != State.Channel || wanted.ChannelOffset != State.ChannelOffset,
+		channel + ":OFFSET " + Number(wanted.ChannelOffset));
+	if (wanted.Averaging)
+	{
+		send(!State.Averaging || wanted.AverageCount != State.AverageCount,
+			":ACQUIRE:AVERAGE:COUNT " + to_string(wanted.AverageCount));
+	}
+	send(wanted.Averaging != State.Averaging, string(":ACQUIRE:AVERAGE ") + (wanted.Averaging ? "ON" : "OFF"));
+	send(wanted.SendValid != State.SendValid, string(":MEASURE:SENDVALID ") + (wanted.SendValid ? "ON" : "OFF"));
+	if (wanted.Waveform)
+	{
+		send(!State.Waveform || wanted.Channel != State.Channel, ":WAVEFORM:SOURCE CHANNEL" + to_string(wanted.Channel));
+		send(!State.Waveform, ":WAVEFORM:FORMAT WORD");
+		send(!State.Waveform, ":WAVEFORM:BYTEORDER LSBFIRST");
+	}
+	if (changed)
+	{
+		ok = Write(":CDISPLAY") && ok;
+	}
+	State = wanted;
+	// Settings sent before a reopen may not have survived it
+	StateKnown = ok && ReconnectCount == reconnects;
+	return ok;
+}
+
+bool ScopeSession::ReadLine(string& line)
+{
+	unsigned long length = 0;
+	int reason = 0;
+	while (Inst != 0 && length < Reply.size())
+	{
+		unsigned long bytesRead = 0;
+		if (iread(Inst, Reply.data() + length, (unsigned long)Reply.size() - length, &reason, &bytesRead) != I_ERR_NOERROR)
+		{
+			return false;
+		}
+		length += bytesRead;
+		if (reason & (I_TERM_END | I_TERM_CHR))
+		{
+			line.assign(Reply.data(), length);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ScopeSession::Measure(const MeasurementSet& set, vector<ScopeReading>& readings)
+{
+	readings.assign(set.Size(), ScopeReading{INVALID_VALUE, false});
+	if (set.Size() == 0)
+	{
+		return true;
+	}
+	string line;
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (Write(set.Query()) && ReadLine(line))
+		{
+			break;
+		}
+		line.clear();
+		if (attempt == 0 && !Recover())
+		{
+			break;
+		}
+	}
+	if (line.empty())
+	{
+		cout << "No reply from the scope to " << set.Query() << endl;
+		return false;
+	}
+
+	// "value[,state];value[,state]...", state 0 meaning a good result
+	const char* next = line.c_str();
+	for (size_t i = 0; i < set.Size(); i++)
+	{
+		char* end;
+		double value = strtod(next, &end);
+		if (end == next)
+		{
+			return false;
+		}
+		readings[i].Value = value;
+		readings[i].Valid = value < INVALID_VALUE;
+		next = end;
+		if (*next == ',')
+		{
+			readings[i].Valid = readings[i].Valid && strtol(next + 1, &end, 10) == 0;
+			next = end;
+		}
+		if (*next == ';')
+		{
+			next++;
+		}
+	}
+	return true;
+}
+
+void SICLCALLBACK ScopeSession::OnServiceRequest(INST id)
+{
+	// The serial poll clears the request; the event bits stay until
+	// *ESR? is read
+	unsigned char status;
+	ireadstb(id, &status);
+	lock_guard<mutex> lock(SessionsLock);
+	auto found = Sessions.find(id);
+	if (found != Sessions.end())
+	{
+		ScopeSession* session = found->second;
+		{
+			lock_guard<mutex> srq(session->SrqLock);
+			session->SrqPending = true;
+		}
+		session->SrqSignal.notify_all();
+	}
+}
+
+bool ScopeSession::StartAcquisition()
+{
+	{
+		lock_guard<mutex> lock(SrqLock);
+		SrqPending = false;
+	}
+	// *CLS drops any completion left over from the last acquisition
+	Acquiring = Write("*CLS") && Write(":DIGITIZE CHANNEL" + to_string(State.Channel) + ";*OPC");
+	return Acquiring;
+}
+
+bool ScopeSession::AcquisitionDone()
+{
+	if (!Acquiring)
+	{
+		return true;
+	}
+	bool requested;
+	{
+		lock_guard<mutex> lock(SrqLock);
+		requested = SrqPending;
+		SrqPending = false;
+	}
+	unsigned char status = 0;
+	if (!requested && (Inst == 0 || ireadstb(Inst, &status) != I_ERR_NOERROR || !(status & STB_ESB)))
+	{
+		return false;
+	}
+	double events;
+	Query("*ESR?", &events);
+	Acquiring = false;
+	return true;
+}
+
+bool ScopeSession::WaitAcquisition(unsigned long timeoutMs)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	while (!AcquisitionDone())
+	{
+		auto now = chrono::steady_clock::now();
+		if (now >= deadline)
+		{
+			cout << "Scope acquisition not complete after " << timeoutMs << " ms" << endl;
+			return false;
+		}
+		unique_lock<mutex> lock(SrqLock);
+		SrqSignal.wait_until(lock, min(deadline, now + chrono::milliseconds(SRQ_POLL_MS)), [this] { return SrqPending; });
+	}
+	return true;
+}
+
+bool ScopeSession::ReadWaveform(vector<short>& words, WaveformScale& scale)
+{
+	if (!PreambleKnown || PreambleSettings != SettingCount || PreambleReconnects != ReconnectCount)
+	{
+		// format, type, points, count, x increment, origin, reference,
+		// y increment, origin, reference, ...
+		string line;
+		double field[10];
+		int fields = 0;
+		if (Write(":WAVEFORM:PREAMBLE?") && ReadLine(line))
+		{
+			stringstream text(line);
+			string item;
+			while (fields < 10 && getline(text, item, ','))
+			{
+				field[fields++] = strtod(item.c_str(), nullptr);
+			}
+		}
+		if (fields < 10)
+		{
+			cout << "No waveform preamble from the scope" << endl;
+			return false;
+		}
+		Preamble = WaveformScale{(unsigned long)field[2], field[4], field[5], field[6], field[7], field[8], field[9]};
+		PreambleKnown = true;
+		PreambleSettings = SettingCount;
+		PreambleReconnects = ReconnectCount;
+	}
+	scale = Preamble;
+
+	// "#" then the number of length digits, the length, the data and
+	// a newline
+	if (!Write(":WAVEFORM:DATA?"))
+	{
+		return false;
+	}
+	char header[10] = {0};
+	unsigned long digits = 0;
+	if (ReadByte(header, 2) == 2 && header[0] == '#' && header[1] >= '1' && header[1] <= '9')
+	{
+		digits = (unsigned long)(header[1] - '0');
+	}
+	if (digits == 0 || ReadByte(header, digits) != digits)
+	{
+		cout << "No waveform block from the scope" << endl;
+		Recover();
+		return false;
+	}
+	header[digits] = '\0';
+	unsigned long bytes = strtoul(header, nullptr, 10);
+	if (bytes % sizeof(short) != 0)
+	{
+		// WORD data is always whole words; anything else is not ours
+		cout << "Waveform block of " << bytes << " bytes is not whole words" << endl;
+		Recover();
+		return false;
+	}
+	words.resize(bytes / sizeof(short));
+	unsigned long got = ReadWord(words.data(), bytes);
+	while (got < bytes)
+	{
+		unsigned long more = ReadByte((char*)words.data() + got, bytes - got);
+		if (more == 0)
+		{
+			cout << "Waveform block ended after " << got << " of " << bytes << " bytes" << endl;
+			Recover();
+			return false;
+		}
+		got += more;
+	}
+	char end;
+	ReadByte(&end, 1);
+	return true;
+}
@@ -0,0 +1,187 @@
+/*------------------------------------------------------------------------
+ Module:        SCOPESESSION.H
+ Project:       StepperMotor
+ Description:   One SICL session to the oscilloscope for the whole scan.
+                The handle is opened once and reused; a failed call is
+                followed by a status-byte check, a device clear and if
+                need be a fresh iopen, then retried once.  The settings
+                last sent are kept so that only changes go out, and a
+                set of measurements is read in one query.  Acquisitions
+                report completion by service request, so the host is free
+                while the scope averages.  Channel records come back as
+                16-bit binary blocks read straight into the caller's
+                buffer.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SCOPESESSION_H_
+#define _SCOPESESSION_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sicl.h"
+
+// The acquisition and measurement settings a scan needs
+struct ScopeState
+{
+	int Channel = 1;               // viewed and measured
+	double TimebaseScale = 0.0;    // s/div
+	double TimebasePosition = 0.0; // s
+	double ChannelScale = 0.0;     // V/div
+	double ChannelOffset = 0.0;    // V
+	bool Averaging = false;
+	int AverageCount = 0;          // only sent when averaging
+	bool SendValid = true;         // measurements answer with a validity code
+	bool Waveform = false;         // channel records read as LSB-first words
+};
+
+// How to turn a record's words into time and volts, from the preamble:
+// t = (i - XReference) * XIncrement + XOrigin, likewise V from the word
+struct WaveformScale
+{
+	unsigned long Points;
+	double XIncrement;
+	double XOrigin;
+	double XReference;
+	double YIncrement;
+	double YOrigin;
+	double YReference;
+};
+
+// One measurement result; with SENDVALID on the scope says whether
+// it could make the measurement
+struct ScopeReading
+{
+	double Value;
+	bool Valid;
+};
+
+// The quantities to measure at each point, asked for in one compound
+// query (":MEASURE:VMIN?;:MEASURE:VAVERAGE?") and answered in order
+class MeasurementSet
+{
+public:
+	// Adds a measurement by its SCPI name (VMIN, VMAX, VAVERAGE or VAVG,
+	// VPP, RISETIME, AREA, ...).  Returns false if the name is unknown;
+	// a quantity already in the set is not added twice.
+	bool Add(const std::string& name);
+
+	// Position of a quantity in the readings, -1 if not in the set
+	int Index(const std::string& name) const;
+
+	size_t Size() const { return Names.size(); }
+	const std::string& Name(size_t index) const { return Names[index]; }
+	const std::string& Query() const { return Text; }
+
+private:
+	std::vector<std::string> Names;
+	std::string Text;
+};
+
+class ScopeSession
+{
+public:
+	// timeoutMs bounds every SICL call.  Acquisitions are waited for
+	// separately, so it need only cover a reply.
+	explicit ScopeSession(const std::string& address, long timeoutMs = 10000);
+	~ScopeSession();
+
+	ScopeSession(const ScopeSession&) = delete;
+	ScopeSession& operator=(const ScopeSession&) = delete;
+
+	// Opens the session if it is not already open, installs the SRQ
+	// handler and enables service requests on operation complete
+	bool Open();
+	void Close();
+	bool IsOpen() const { return Inst != 0; }
+
+	// Reads the status byte; if that fails, clears the device, and if
+	// that fails too, reopens the session.  Returns false if the scope
+	// cannot be reached at all.
+	bool Check();
+
+	// A command, newline added
+	bool Write(const std::string& command);
+
+	// A query and its numeric reply.  Unlike Write then ReadDouble, a
+	// query that fails is resent after reconnecting.  Anything after the
+	// number (e.g. the ",state" of a SENDVALID reply) is read and dropped
+	// so it cannot be taken for the next reply.
+	bool Query(const std::string& command, double* value);
+	bool ReadDouble(double* value);
+
+	// Sends only the settings that differ from those last applied, all
+	// of them when the scope's state is not known, then clears the
+	// display if anything changed so no averages taken under the old
+	// settings remain.  Returns false if any command was not taken.
+	bool Apply(const ScopeState& wanted);
+
+	// The scope's settings were changed behind the session's back
+	void Forget() { StateKnown = false; }
+
+	// Sends the set's compound query and parses every result from the
+	// one reply.  readings is resized to the set; false if the reply did
+	// not come or held fewer results than asked for.
+	bool Measure(const MeasurementSet& set, std::vector<ScopeReading>& readings);
+
+	// Starts a single acquisition of the measured channel (the full
+	// average count when averaging) and returns at once.  *OPC raises a
+	// service request when it is complete.
+	bool StartAcquisition();
+
+	// True once the acquisition last started is complete; never blocks
+	bool AcquisitionDone();
+
+	// Sleeps until the service request arrives, polling the status byte
+	// now and then in case it is lost.  False after timeoutMs.
+	bool WaitAcquisition(unsigned long timeoutMs);
+
+	// Reads the last acquisition of the measured channel (ScopeState
+	// Waveform set) as an IEEE 488.2 definite-length block straight into
+	// words, which keeps its capacity from one call to the next.  The
+	// preamble is read again only after the settings or session changed.
+	bool ReadWaveform(std::vector<short>& words, WaveformScale& scale);
+
+	// Raw reply bytes, e.g. binary blocks.  The short buffer is 2 bytes
+	// wide but iread counts bytes, so it is passed as chars.  A failed
+	// read (timeout, lost session) counts as nothing read.
+	unsigned long ReadWord(short* buffer, unsigned long bytesToRead);
+	unsigned long ReadByte(char* buffer, unsigned long bytesToRead);
+
+	void SetTimeout(long timeoutMs);
+
+	INST Handle() const { return Inst; }
+	const std::string& Address() const { return Name; }
+	unsigned long Reconnects() const { return ReconnectCount; }
+	unsigned long SettingsSent() const { return SettingCount; }
+
+private:
+	// Status check, clear, reopen: whatever it takes to talk again
+	bool Recover();
+	bool ReadLine(std::string& line);
+	bool Send(const std::string& command);
+
+	static void SICLCALLBACK OnServiceRequest(INST id);
+
+	std::string Name;
+	long TimeoutMs;
+	INST Inst;
+	unsigned long ReconnectCount;
+	ScopeState State;
+	bool StateKnown;
+	unsigned long SettingCount;
+	std::vector<char> Reply;
+	bool Acquiring;
+	std::mutex SrqLock;
+	std::condition_variable SrqSignal;
+	bool SrqPending;
+	WaveformScale Preamble;
+	bool PreambleKnown;
+	unsigned long PreambleSettings;  // SettingCount when it was read
+	unsigned long PreambleReconnects;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/*------------------------------------------------------------------------
+ Module:        SETTLEGATE.CPP
+ Project:       StepperMotor
+ Description:   Settling detection after a move.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <thread>
+
+#include "settlegate.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define SETTLE_READ_MS 250 // wait for each position reply
+
+SettleGate::SettleGate(PositionTracker& position, const MotionModel& motion, unsigned int reads, long toleranceSteps,
+	unsigned long timeoutMs)
+	: Position(position), Motion(motion), Reads(reads), ToleranceSteps(toleranceSteps), TimeoutMs(timeoutMs), ProbeTolerance(0.0)
+{
+}
+
+void SettleGate::SetProbe(const function<bool(double*)>& probe, double tolerance)
+{
+	Probe = probe;
+	ProbeTolerance = tolerance;
+}
+
+SettleResult SettleGate::Wait(long x, long y)
+{
+	SettleResult result = {false, 0.0, 0};
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = start + chrono::milliseconds(TimeoutMs);
+	unsigned int steady = 0;   // position reads in a row on target
+	deque<double> readings;    // last probe readings
+	bool needPosition = Reads > 0;
+	bool needProbe = (bool)Probe;
+	if (!needPosition && !needProbe)
+	{
+		// Nothing to watch, so allow the settling the move-time fit found
+		double dwell = max(Motion.Axis[MOTION_X].Settle, Motion.Axis[MOTION_Y].Settle);
+		this_thread::sleep_until(min(deadline, start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(dwell))));
+	}
+	while (needPosition || needProbe)
+	{
+		if (Clock::now() >= deadline)
+		{
+			result.Seconds = chrono::duration<double>(Clock::now() - start).count();
+			return result;
+		}
+		result.Reads++;
+		if (needPosition)
+		{
+			if (Position.Verify(SETTLE_READ_MS)
+				&& labs(Position.X() - x) <= ToleranceSteps && labs(Position.Y() - y) <= ToleranceSteps)
+			{
+				steady++;
+			}
+			else
+			{
+				steady = 0;
+			}
+			needPosition = steady < Reads;
+		}
+		if (needProbe)
+		{
+			double reading;
+			if (Probe(&reading))
+			{
+				readings.push_back(reading);
+				if (readings.size() > max(Reads, 2u))
+				{
+					readings.pop_front();
+				}
+			}
+			if (readings.size() == max(Reads, 2u))
+			{
+				auto span = minmax_element(readings.begin(), readings.end());
+				needProbe = *span.second - *span.first > ProbeTolerance;
+			}
+		}
+	}
+	result.Settled = true;
+	result.Seconds = chrono::duration<double>(Clock::now() - start).count();
+	return result;
+}
@@ -0,0 +1,57 @@
+/*------------------------------------------------------------------------
+ Module:        SETTLEGATE.H
+ Project:       StepperMotor
+ Description:   Decides when the stage has settled after a move, so a
+                point is measured as soon as it is still rather than
+                after a fixed wait.  The drives' positions, and
+                optionally a probe reading such as the scope baseline,
+                must hold steady for several reads in a row; with no
+                test set, the motion model's fitted settle time is
+                waited instead.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SETTLEGATE_H_
+#define _SETTLEGATE_H_
+
+#include <functional>
+
+#include "motionmodel.h"
+#include "positiontracker.h"
+
+struct SettleResult
+{
+	bool Settled;   // false if timeoutMs ran out first
+	double Seconds; // from the call to the decision
+	int Reads;      // position (and probe) reads taken
+};
+
+class SettleGate
+{
+public:
+	// reads in a row must find both drives within toleranceSteps of the
+	// target; reads of 0 skips the position test.  Positions are read
+	// through the tracker, so each read also verifies it.  Until a test
+	// is set, each point waits the longer axis's Settle term of motion
+	// (current at the time of the call, so it follows refits).
+	SettleGate(PositionTracker& position, const MotionModel& motion, unsigned int reads, long toleranceSteps,
+		unsigned long timeoutMs);
+
+	// Adds a second test: probe fills in a reading (returning false if
+	// it could not) and the last reads readings must span no more than
+	// tolerance
+	void SetProbe(const std::function<bool(double*)>& probe, double tolerance);
+
+	SettleResult Wait(long x, long y);
+
+private:
+	PositionTracker& Position;
+	const MotionModel& Motion;
+	unsigned int Reads;
+	long ToleranceSteps;
+	unsigned long TimeoutMs;
+	std::function<bool(double*)> Probe;
+	double ProbeTolerance;
+};
+
+#endif
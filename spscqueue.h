@@ -0,0 +1,88 @@
+/*------------------------------------------------------------------------
+ Module:        SPSCQUEUE.H
+ Project:       StepperMotor
+ Description:   Fixed-capacity lock-free queue for exactly one producer
+                thread and one consumer thread.  Storage is inline, so
+                pushing and popping never lock or allocate.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+		"SpscQueue capacity must be a power of two");
+
+public:
+	SpscQueue() : Head(0), Tail(0) {}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	// Producer side.  Returns false if the queue is full.
+	bool Push(const T& item)
+	{
+		return PushMany(&item, 1);
+	}
+
+	// Producer side.  Publishes all items at once or none, so the
+	// consumer never sees part of a batch.
+	bool PushMany(const T* items, size_t count)
+	{
+		size_t tail = Tail.load(std::memory_order_relaxed);
+		size_t head = Head.load(std::memory_order_acquire);
+		if (Capacity - (tail - head) < count)
+		{
+			return false;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			Items[(tail + i) & (Capacity - 1)] = items[i];
+		}
+		Tail.store(tail + count, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side.  Returns false if the queue is empty.
+	bool Pop(T& item)
+	{
+		return PopMany(&item, 1) == 1;
+	}
+
+	// Consumer side.  Takes up to maxItems, returns how many.
+	size_t PopMany(T* items, size_t maxItems)
+	{
+		size_t head = Head.load(std::memory_order_relaxed);
+		size_t tail = Tail.load(std::memory_order_acquire);
+		size_t count = tail - head < maxItems ? tail - head : maxItems;
+		for (size_t i = 0; i < count; i++)
+		{
+			items[i] = Items[(head + i) & (Capacity - 1)];
+		}
+		Head.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+	// Approximate when called from neither side
+	size_t Size() const
+	{
+		return Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire);
+	}
+
+	bool Empty() const { return Size() == 0; }
+
+private:
+	// Head and tail are free running; each sits on its own cache line so
+	// the two threads do not contend on writes.
+	alignas(64) std::atomic<size_t> Head; // written by the consumer
+	alignas(64) std::atomic<size_t> Tail; // written by the producer
+	alignas(64) T Items[Capacity];
+};
+
+#endif
@@ -0,0 +1,141 @@
+/*------------------------------------------------------------------------
+ Module:        TOURPLANNER.CPP
+ Project:       StepperMotor
+ Description:   Visiting order for an arbitrary set of stage targets.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <cmath>
+
+#include "tourplanner.h"
+
+using namespace std;
+
+#define IMPROVEMENT 1e-9 // seconds; smaller gains are rounding noise
+#define MAX_ROUNDS  100  // 2-opt/Or-opt rounds before giving up
+#define OROPT_MAX   3    // longest segment Or-opt relocates
+
+MoveCostFn ChebyshevCost(double xRate, double yRate)
+{
+	return [xRate, yRate](const StagePoint& a, const StagePoint& b)
+	{
+		return max(fabs(b.X - a.X) / xRate, fabs(b.Y - a.Y) / yRate);
+	};
+}
+
+double TourCost(const vector<StagePoint>& points, const vector<size_t>& order,
+	const StagePoint& start, const MoveCostFn& cost)
+{
+	double total = 0.0;
+	const StagePoint* from = &start;
+	for (size_t index : order)
+	{
+		total += cost(*from, points[index]);
+		from = &points[index];
+	}
+	return total;
+}
+
+vector<size_t> PlanTour(const vector<StagePoint>& points, const StagePoint& start,
+	const MoveCostFn& cost)
+{
+	size_t n = points.size();
+	if (n < 2)
+	{
+		return vector<size_t>(n, 0);
+	}
+
+	// Node n stands for the start position and stays at the front of
+	// the path; "after" the last node costs nothing.
+	auto at = [&](size_t node) -> const StagePoint& { return node == n ? start : points[node]; };
+	auto d = [&](size_t a, size_t b) { return cost(at(a), at(b)); };
+
+	vector<size_t> path;
+	path.reserve(n + 1);
+	path.push_back(n);
+	vector<bool> visited(n, false);
+	for (size_t step = 0; step < n; step++)
+	{
+		size_t best = n;
+		double bestCost = 0.0;
+		for (size_t candidate = 0; candidate < n; candidate++)
+		{
+			if (visited[candidate])
+			{
+				continue;
+			}
+			double c = d(path.back(), candidate);
+			if (best == n || c < bestCost)
+			{
+				best = candidate;
+				bestCost = c;
+			}
+		}
+		visited[best] = true;
+		path.push_back(best);
+	}
+
+	size_t m = path.size();
+	auto link = [&](size_t k) { return k + 1 < m ? d(path[k], path[k + 1]) : 0.0; };
+	bool improved = true;
+	for (int round = 0; improved && round < MAX_ROUNDS; round++)
+	{
+		improved = false;
+
+		// 2-opt: reverse path[i..j]
+		for (size_t i = 1; i + 1 < m; i++)
+		{
+			for (size_t j = i + 1; j < m; j++)
+			{
+				double before = d(path[i - 1], path[i]) + link(j);
+				double after = d(path[i - 1], path[j]) + (j + 1 < m ? d(path[i], path[j + 1]) : 0.0);
+				if (after < before - IMPROVEMENT)
+				{
+					reverse(path.begin() + i, path.begin() + j + 1);
+					improved = true;
+				}
+			}
+		}
+
+		// Or-opt: move a run of up to OROPT_MAX points, either way round,
+		// to sit after path[j]
+		for (size_t length = 1; length <= OROPT_MAX; length++)
+		{
+			for (size_t i = 1; i + length <= m; i++)
+			{
+				size_t first = path[i], last = path[i + length - 1];
+				size_t prev = path[i - 1];
+				bool hasNext = i + length < m;
+				double removed = d(prev, first) + (hasNext ? d(last, path[i + length]) - d(prev, path[i + length]) : 0.0);
+				for (size_t j = 0; j < m; j++)
+				{
+					if (j + 1 >= i && j < i + length)
+					{
+						continue; // inside the run or directly before it
+					}
+					bool atEnd = j + 1 == m;
+					double gap = atEnd ? 0.0 : d(path[j], path[j + 1]);
+					double forward = d(path[j], first) + (atEnd ? 0.0 : d(last, path[j + 1])) - gap;
+					double backward = d(path[j], last) + (atEnd ? 0.0 : d(first, path[j + 1])) - gap;
+					double added = min(forward, backward);
+					if (added < removed - IMPROVEMENT)
+					{
+						vector<size_t> run(path.begin() + i, path.begin() + i + length);
+						if (backward < forward)
+						{
+							reverse(run.begin(), run.end());
+						}
+						path.erase(path.begin() + i, path.begin() + i + length);
+						size_t insert = j < i ? j + 1 : j + 1 - length;
+						path.insert(path.begin() + insert, run.begin(), run.end());
+						improved = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	return vector<size_t>(path.begin() + 1, path.end());
+}
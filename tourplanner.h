@@ -0,0 +1,34 @@
+/*------------------------------------------------------------------------
+ Module:        TOURPLANNER.H
+ Project:       StepperMotor
+ Description:   Visiting order for an arbitrary set of stage targets
+                that keeps total move time low.  Both stages move at
+                once, so a move costs as long as its slower axis.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _TOURPLANNER_H_
+#define _TOURPLANNER_H_
+
+#include <functional>
+#include <vector>
+
+#include "scanorder.h"
+
+// Seconds to move between two points.  Must be symmetric.
+typedef std::function<double(const StagePoint&, const StagePoint&)> MoveCostFn;
+
+// max(|dx| / xRate, |dy| / yRate), rates in microsteps per second
+MoveCostFn ChebyshevCost(double xRate, double yRate);
+
+// Time to visit points in order, starting from start
+double TourCost(const std::vector<StagePoint>& points, const std::vector<size_t>& order,
+	const StagePoint& start, const MoveCostFn& cost);
+
+// Nearest-neighbour path from start, improved with 2-opt and Or-opt
+// moves until neither helps.  Returns indices into points.  The path
+// is open: it ends at the last point rather than returning to start.
+std::vector<size_t> PlanTour(const std::vector<StagePoint>& points, const StagePoint& start,
+	const MoveCostFn& cost);
+
+#endif
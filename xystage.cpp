@@ -0,0 +1,154 @@
+/*------------------------------------------------------------------------
+ Module:        XYSTAGE.CPP
+ Project:       StepperMotor
+ Description:   The X and Y Zaber drives of the scan rig driven as one
+                stage.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "xystage.h"
+
+using namespace std;
+
+XYStage::XYStage(ZaberLink& zaber, unsigned char xUnit, unsigned char yUnit)
+	: Zaber(zaber), XUnit(xUnit), YUnit(yUnit)
+{
+	ForgetSettings();
+}
+
+void XYStage::ForgetSettings()
+{
+	for (int axis = 0; axis < 2; axis++)
+	{
+		SpeedData[axis] = 0;
+		AccelData[axis] = 0;
+	}
+}
+
+bool XYStage::GetPositions(long* x, long* y, unsigned long timeoutMs)
+{
+	vector<future<long>> replies = Zaber.RequestMany({
+		{XUnit, ZABER_RETURNPOS, 64},
+		{YUnit, ZABER_RETURNPOS, 64}});
+	try
+	{
+		if (Zaber.AwaitAll(replies, timeoutMs))
+		{
+			*x = replies[0].get();
+			*y = replies[1].get();
+			return true;
+		}
+	}
+	catch (const ZaberError& e)
+	{
+		cout << e.what() << endl;
+	}
+	Zaber.CancelAll();
+	return false;
+}
+
+MoveResult XYStage::MoveTo(long x, long y, unsigned long timeoutMs, const MoveProfile* profile)
+{
+	MoveResult result = {false, x, y, 0.0, -1.0, -1.0};
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::milliseconds(timeoutMs);
+
+	// Settings that differ from the drives' go ahead of the moves
+	vector<PSERIAL_PACKET> commands;
+	const unsigned char units[2] = {XUnit, YUnit};
+	for (int axis = 0; profile != nullptr && axis < 2; axis++)
+	{
+		if (profile->Velocity[axis] <= 0)
+		{
+			continue;
+		}
+		long speed = max(1L, lround(profile->Velocity[axis] * ZABER_SPEEDSCALE));
+		long accel = max(1L, lround(profile->Accel[axis] * ZABER_ACCELSCALE));
+		if (speed != SpeedData[axis])
+		{
+			commands.push_back(PSERIAL_PACKET{units[axis], ZABER_SETTARGETSPEED, speed});
+			SpeedData[axis] = speed;
+		}
+		if (accel != AccelData[axis])
+		{
+			commands.push_back(PSERIAL_PACKET{units[axis], ZABER_SETACCELERATION, accel});
+			AccelData[axis] = accel;
+		}
+	}
+	size_t settings = commands.size();
+
+	// One write for both axes so they start together
+	commands.push_back(PSERIAL_PACKET{XUnit, ZABER_MOVEABSOLUTE, x});
+	commands.push_back(PSERIAL_PACKET{YUnit, ZABER_MOVEABSOLUTE, y});
+	vector<future<long>> sent = Zaber.RequestMany(commands);
+	vector<future<long>> replies;
+	replies.push_back(move(sent[settings]));
+	replies.push_back(move(sent[settings + 1]));
+
+	// Pump until both finish, noting when each reply lands so the
+	// motion model gets per-axis times
+	double* finished[2] = {&result.XSeconds, &result.YSeconds};
+	int waiting = 2;
+	for (;;)
+	{
+		auto now = chrono::steady_clock::now();
+		for (int axis = 0; axis < 2; axis++)
+		{
+			if (*finished[axis] < 0 && replies[axis].wait_for(chrono::seconds(0)) == future_status::ready)
+			{
+				*finished[axis] = chrono::duration<double>(now - start).count();
+				waiting--;
+			}
+		}
+		if (waiting == 0 || now >= deadline)
+		{
+			break;
+		}
+		Zaber.Pump((unsigned long)chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1);
+	}
+	try
+	{
+		if (waiting == 0)
+		{
+			// Move-absolute replies carry the position the drive stopped at
+			result.X = replies[0].get();
+			result.Y = replies[1].get();
+			result.Arrived = true;
+		}
+	}
+	catch (const ZaberError& e)
+	{
+		cout << e.what() << endl;
+	}
+	for (size_t i = 0; i < settings; i++)
+	{
+		try
+		{
+			if (sent[i].wait_for(chrono::seconds(0)) != future_status::ready)
+			{
+				ForgetSettings();
+			}
+			else
+			{
+				sent[i].get();
+			}
+		}
+		catch (const exception& e)
+		{
+			// Rejected or cancelled: the drive keeps its old setting
+			cout << e.what() << endl;
+			ForgetSettings();
+		}
+	}
+	if (!result.Arrived)
+	{
+		Zaber.CancelAll();
+	}
+	result.Seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return result;
+}
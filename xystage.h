@@ -0,0 +1,56 @@
+/*------------------------------------------------------------------------
+ Module:        XYSTAGE.H
+ Project:       StepperMotor
+ Description:   The X and Y Zaber drives of the scan rig driven as one
+                stage.  Moves complete on the drives' own move-absolute
+                replies rather than on an estimated sleep.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _XYSTAGE_H_
+#define _XYSTAGE_H_
+
+#include "motionmodel.h"
+#include "zaberlink.h"
+
+struct MoveResult
+{
+	bool Arrived;   // both drives reported completion before the timeout
+	long X;         // position reported by (or commanded to) each drive
+	long Y;
+	double Seconds; // command to last completion reply
+	double XSeconds; // command to each drive's own completion reply,
+	double YSeconds; // or -1 if it never came
+};
+
+class XYStage
+{
+public:
+	XYStage(ZaberLink& zaber, unsigned char xUnit = 1, unsigned char yUnit = 2);
+
+	// Queries both drives with their requests in flight together
+	bool GetPositions(long* x, long* y, unsigned long timeoutMs);
+
+	// Starts both axes and returns as soon as both report arrival, or
+	// after timeoutMs with Arrived false.  A profile's speed and
+	// acceleration go out in the same write as the moves, skipping any
+	// the drive already has.
+	MoveResult MoveTo(long x, long y, unsigned long timeoutMs, const MoveProfile* profile = nullptr);
+
+	// For callers that change drive settings directly: the next profile
+	// is sent in full
+	void ForgetSettings();
+
+	ZaberLink& Link() { return Zaber; }
+	unsigned char XAxisUnit() const { return XUnit; }
+	unsigned char YAxisUnit() const { return YUnit; }
+
+private:
+	ZaberLink& Zaber;
+	unsigned char XUnit;
+	unsigned char YUnit;
+	long SpeedData[2]; // as last programmed, per axis; 0 if not known
+	long AccelData[2];
+};
+
+#endif
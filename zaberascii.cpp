@@ -0,0 +1,358 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERASCII.CPP
+ Project:       StepperMotor
+ Description:   Zaber ASCII protocol engine.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#include "zaberascii.h"
+
+using namespace std;
+
+#define MAX_MESSAGE_ID 99
+#define RX_CHUNK 256
+
+ZaberAscii::ZaberAscii(ZaberChannel& port)
+	: Port(port), UnitCount(port.Units()), Targets(port.Units() + 1),
+	  NextId(0), Checksummed(false), BadChecksums(0)
+{
+	for (int unit = 0; unit <= UnitCount; unit++)
+	{
+		Targets[unit] = Target{unit, 0};
+	}
+}
+
+ZaberAscii::~ZaberAscii()
+{
+	CancelAll();
+}
+
+void ZaberAscii::MapUnit(unsigned char unit, int device, int axis)
+{
+	if (unit == 0 || unit > UnitCount)
+	{
+		throw out_of_range("Zaber unit " + to_string(unit) + " is not in the chain");
+	}
+	Targets[unit] = Target{device, axis};
+}
+
+string ZaberAscii::Checksum(const string& body)
+{
+	unsigned int sum = 0;
+	for (unsigned char c : body)
+	{
+		sum += c;
+	}
+	char hex[3];
+	snprintf(hex, sizeof(hex), "%02X", (256 - (sum & 0xFF)) & 0xFF);
+	return hex;
+}
+
+string ZaberAscii::Translate(unsigned char command, long data) const
+{
+	switch (command)
+	{
+	case ZABER_HOME:             return "home";
+	case ZABER_RENUMBER:         return "renumber";
+	case ZABER_MOVEABSOLUTE:     return "move abs " + to_string(data);
+	case ZABER_MOVERELATIVE:     return "move rel " + to_string(data);
+	case ZABER_STOP:             return "stop";
+	case ZABER_RETURNPOS:        return "get pos";
+	case ZABER_SETTARGETSPEED:   return "set maxspeed " + to_string(data);
+	case ZABER_SETACCELERATION:  return "set accel " + to_string(data);
+	case ZABER_RETURNSETTING:
+		if (data == ZABER_SETTARGETSPEED)
+		{
+			return "get maxspeed";
+		}
+		if (data == ZABER_SETACCELERATION)
+		{
+			return "get accel";
+		}
+		break;
+	}
+	throw invalid_argument("Zaber command " + to_string(command) + " has no ASCII equivalent");
+}
+
+string ZaberAscii::Frame(int device, int axis, int id, const string& text) const
+{
+	string body = to_string(device) + " " + to_string(axis) + " " + to_string(id) + " " + text;
+	return "/" + body + ":" + Checksum(body) + "\n";
+}
+
+int ZaberAscii::TakeId()
+{
+	int id = NextId;
+	NextId = (NextId + 1) % (MAX_MESSAGE_ID + 1);
+	return id;
+}
+
+future<long> ZaberAscii::Expect(unsigned char unit, int device, int axis, unsigned char command, int id)
+{
+	Queue.push_back(Outstanding{id, unit, device, axis, command, false, false, promise<long>()});
+	return Queue.back().Reply.get_future();
+}
+
+future<long> ZaberAscii::Request(unsigned char unit, unsigned char command, long data)
+{
+	vector<future<long>> replies = RequestMany({{unit, command, data}});
+	return move(replies[0]);
+}
+
+vector<future<long>> ZaberAscii::RequestMany(const vector<PSERIAL_PACKET>& commands)
+{
+	string text;
+	vector<future<long>> replies;
+	for (const PSERIAL_PACKET& command : commands)
+	{
+		if (command.Unit == 0 || command.Unit > UnitCount)
+		{
+			throw out_of_range("Zaber unit " + to_string(command.Unit) + " is not in the chain");
+		}
+		Translate(command.Command, command.Data); // reject before anything is queued
+	}
+	for (const PSERIAL_PACKET& command : commands)
+	{
+		const Target& target = Targets[command.Unit];
+		int id = TakeId();
+		text += Frame(target.Device, target.Axis, id, Translate(command.Command, command.Data));
+		replies.push_back(Expect(command.Unit, target.Device, target.Axis, command.Command, id));
+	}
+	Port.WriteRaw((const unsigned char*)text.data(), (unsigned long)text.size());
+	return replies;
+}
+
+vector<future<long>> ZaberAscii::Broadcast(unsigned char command, long data)
+{
+	string text = Translate(command, data);
+	int id = TakeId();
+	vector<future<long>> replies;
+	for (unsigned char unit = 1; unit <= UnitCount; unit++)
+	{
+		replies.push_back(Expect(unit, Targets[unit].Device, Targets[unit].Axis, command, id));
+	}
+	string framed = Frame(0, 0, id, text);
+	Port.WriteRaw((const unsigned char*)framed.data(), (unsigned long)framed.size());
+	return replies;
+}
+
+bool ZaberAscii::Initialize(unsigned long timeoutMs)
+{
+	// Devices answer "set comm.checksum 1" either way, so checksums are
+	// only demanded once every one has taken it
+	Checksummed = false;
+	if (!SetAll("comm.checksum 1", timeoutMs))
+	{
+		return false;
+	}
+	Checksummed = true;
+	return SetAll("comm.alert 1", timeoutMs);
+}
+
+bool ZaberAscii::SetAll(const string& setting, unsigned long timeoutMs)
+{
+	int id = TakeId();
+	vector<future<long>> replies;
+	vector<int> devices;
+	for (unsigned char unit = 1; unit <= UnitCount; unit++)
+	{
+		int device = Targets[unit].Device;
+		bool seen = false;
+		for (int d : devices)
+		{
+			seen = seen || d == device;
+		}
+		if (!seen)
+		{
+			devices.push_back(device);
+			replies.push_back(Expect(unit, device, 0, 0, id));
+		}
+	}
+	string framed = Frame(0, 0, id, "set " + setting);
+	Port.WriteRaw((const unsigned char*)framed.data(), (unsigned long)framed.size());
+	try
+	{
+		if (AwaitAll(replies, timeoutMs))
+		{
+			for (future<long>& reply : replies)
+			{
+				reply.get();
+			}
+			return true;
+		}
+	}
+	catch (const ZaberError&)
+	{
+	}
+	CancelAll();
+	return false;
+}
+
+void ZaberAscii::FinishMove(list<Outstanding>::iterator entry)
+{
+	// Motion commands resolve with where the axis stopped, so ask for it
+	// under a new ID and hand the original promise to that request.  A
+	// move of all axes finishes only once that reply's device status is
+	// IDLE too: one axis stopping says nothing of the others.
+	int id = TakeId();
+	string framed = Frame(entry->Device, entry->Axis, id, Translate(ZABER_RETURNPOS, 0));
+	entry->Id = id;
+	entry->Command = ZABER_RETURNPOS;
+	entry->Moving = false;
+	entry->Polling = entry->Axis == 0;
+	Port.WriteRaw((const unsigned char*)framed.data(), (unsigned long)framed.size());
+}
+
+long ZaberAscii::Field(const string& data, int index)
+{
+	istringstream fields(data);
+	string field;
+	for (int i = 0; i <= index; i++)
+	{
+		field.clear();
+		fields >> field;
+	}
+	return strtol(field.c_str(), nullptr, 10);
+}
+
+void ZaberAscii::Dispatch(const string& received)
+{
+	string line = received;
+	if (line.empty())
+	{
+		return;
+	}
+
+	// Verify and strip the checksum; once the devices were told to send
+	// one, a line without it is as suspect as one that does not add up
+	size_t colon = line.rfind(':');
+	if (colon != string::npos && colon + 3 == line.size())
+	{
+		string body = line.substr(1, colon - 1);
+		if (Checksum(body) != line.substr(colon + 1))
+		{
+			BadChecksums++;
+			return;
+		}
+		line = line.substr(0, colon);
+	}
+	else if (Checksummed)
+	{
+		BadChecksums++;
+		return;
+	}
+
+	char type = line[0];
+	istringstream fields(line.substr(1));
+	int device = 0, axis = 0;
+	fields >> device >> axis;
+
+	if (type == '!')
+	{
+		// Alert: "!01 1 IDLE --" once an axis has finished its move, or
+		// axis 0 once the whole device has.  A move of all axes asks
+		// again after each one, so the last stop is never missed.
+		string status;
+		fields >> status;
+		if (status != "IDLE")
+		{
+			return;
+		}
+		for (auto it = Queue.begin(); it != Queue.end(); ++it)
+		{
+			bool all = it->Axis == 0;
+			if (it->Device == device && (it->Moving || (all && it->Polling))
+				&& (axis == 0 || all || it->Axis == axis))
+			{
+				FinishMove(it);
+			}
+		}
+		return;
+	}
+	if (type != '@')
+	{
+		return; // info lines ('#') carry nothing we wait for
+	}
+
+	// Reply: "@01 0 12 OK IDLE -- 12345"
+	int id = -1;
+	string flag, status, warning, data;
+	fields >> id >> flag >> status >> warning;
+	getline(fields >> ws, data);
+
+	// A broadcast has one entry per unit but one reply per device, so
+	// every entry of this device under the ID is answered here
+	auto it = Queue.begin();
+	while (it != Queue.end())
+	{
+		if (it->Id != id || it->Moving || (it->Device != device && it->Device != 0))
+		{
+			++it;
+			continue;
+		}
+		if (flag != "OK")
+		{
+			it->Reply.set_exception(make_exception_ptr(ZaberError(it->Unit, data)));
+			it = Queue.erase(it);
+			continue;
+		}
+		bool motion = it->Command == ZABER_HOME || it->Command == ZABER_MOVEABSOLUTE
+			|| it->Command == ZABER_MOVERELATIVE;
+		if (motion)
+		{
+			it->Moving = true;
+			if (status == "IDLE")
+			{
+				FinishMove(it); // already there, so no alert will follow
+			}
+			++it;
+			continue;
+		}
+		if (it->Polling && status != "IDLE")
+		{
+			// Another axis is still moving; its alert will follow
+			it->Polling = false;
+			it->Moving = true;
+			++it;
+			continue;
+		}
+		// A reply for all axes lists each axis's value in turn
+		it->Reply.set_value(Field(data, axis == 0 && it->Axis > 0 ? it->Axis - 1 : 0));
+		it = Queue.erase(it);
+	}
+}
+
+int ZaberAscii::Pump(unsigned long timeoutMs)
+{
+	unsigned char chunk[RX_CHUNK];
+	int handled = 0;
+	unsigned long count = Port.ReadRaw(chunk, sizeof(chunk), timeoutMs);
+	while (count > 0)
+	{
+		RxLine.append((const char*)chunk, count);
+		count = Port.ReadRaw(chunk, sizeof(chunk), 0);
+	}
+	size_t end;
+	while ((end = RxLine.find('\n')) != string::npos)
+	{
+		string line = RxLine.substr(0, end);
+		RxLine.erase(0, end + 1);
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		Dispatch(line);
+		handled++;
+	}
+	return handled;
+}
+
+void ZaberAscii::CancelAll()
+{
+	Queue.clear();
+	RxLine.clear();
+}
@@ -0,0 +1,100 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERASCII.H
+ Project:       StepperMotor
+ Description:   Zaber ASCII protocol engine.  Requests carry message IDs
+                and checksums, replies are matched by ID and verified
+                and motion commands complete on the devices' IDLE
+                alerts.  Intended for 115200 baud links.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERASCII_H_
+#define _ZABERASCII_H_
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "zaberchannel.h"
+#include "zaberlink.h"
+
+// Logical unit n is device n, all axes, unless remapped with MapUnit
+// (e.g. both stages on axes 1 and 2 of one multi-axis controller).
+class ZaberAscii : public ZaberLink
+{
+public:
+	explicit ZaberAscii(ZaberChannel& port);
+	~ZaberAscii();
+
+	ZaberAscii(const ZaberAscii&) = delete;
+	ZaberAscii& operator=(const ZaberAscii&) = delete;
+
+	void MapUnit(unsigned char unit, int device, int axis);
+
+	// Has every device checksum its replies, then enables the IDLE
+	// alerts that complete motion commands.  From then on a reply
+	// without a checksum counts as bad.  Returns false if any device did
+	// not accept a setting in time.
+	bool Initialize(unsigned long timeoutMs);
+
+	std::future<long> Request(unsigned char unit, unsigned char command, long data) override;
+
+	// All commands go out in one write, each with its own message ID
+	std::vector<std::future<long>> RequestMany(const std::vector<PSERIAL_PACKET>& commands) override;
+
+	// Sent to device 0; one future per unit.  Each device answers once
+	// for all its axes, and that reply resolves every unit on it.
+	std::vector<std::future<long>> Broadcast(unsigned char command, long data) override;
+
+	int Pump(unsigned long timeoutMs) override;
+
+	void CancelAll() override;
+
+	size_t Pending() const override { return Queue.size(); }
+
+	unsigned char Units() const override { return UnitCount; }
+
+	unsigned long ChecksumErrors() const { return BadChecksums; }
+
+	// Two hex digits making the byte sum of body plus checksum zero
+	static std::string Checksum(const std::string& body);
+
+private:
+	struct Target
+	{
+		int Device;
+		int Axis;
+	};
+
+	struct Outstanding
+	{
+		int Id;
+		unsigned char Unit;
+		int Device;
+		int Axis;
+		unsigned char Command;
+		bool Moving;          // accepted, waiting for the IDLE alert
+		bool Polling;         // all-axes move asking if every axis is idle
+		std::promise<long> Reply;
+	};
+
+	std::string Translate(unsigned char command, long data) const;
+	std::string Frame(int device, int axis, int id, const std::string& text) const;
+	std::future<long> Expect(unsigned char unit, int device, int axis, unsigned char command, int id);
+	void Dispatch(const std::string& line);
+	void FinishMove(std::list<Outstanding>::iterator entry);
+	bool SetAll(const std::string& setting, unsigned long timeoutMs);
+	static long Field(const std::string& data, int index);
+	int TakeId();
+
+	ZaberChannel& Port;
+	unsigned char UnitCount;
+	std::vector<Target> Targets;  // indexed by unit
+	std::list<Outstanding> Queue;
+	std::string RxLine;
+	int NextId;
+	bool Checksummed;             // replies must carry a checksum
+	unsigned long BadChecksums;
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERASYNC.CPP
+ Project:       StepperMotor
+ Description:   Asynchronous command/reply correlation for daisy-chained
+                Zaber units on one ZaberChannel, binary protocol.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <string>
+
+#include "zaberasync.h"
+
+using namespace std;
+
+#define PUMP_BATCH 16
+
+ZaberAsync::ZaberAsync(ZaberChannel& port)
+	: Port(port), UnitCount(port.Units()), Queues(port.Units() + 1)
+{
+}
+
+ZaberAsync::~ZaberAsync()
+{
+	CancelAll();
+}
+
+future<long> ZaberAsync::Expect(unsigned char unit, unsigned char command, long data)
+{
+	// Return Setting is answered under the number of the setting asked for
+	if (command == ZABER_RETURNSETTING)
+	{
+		command = (unsigned char)data;
+	}
+	Queues[unit].push_back(Outstanding{command, promise<long>()});
+	return Queues[unit].back().Reply.get_future();
+}
+
+future<long> ZaberAsync::Request(unsigned char unit, unsigned char command, long data)
+{
+	if (unit == 0 || unit > UnitCount)
+	{
+		throw out_of_range("Zaber unit " + to_string(unit) + " is not in the chain");
+	}
+	future<long> reply = Expect(unit, command, data);
+	Port.Send(unit, command, data);
+	return reply;
+}
+
+bool ZaberAsync::CoversChain(const vector<PSERIAL_PACKET>& commands) const
+{
+	if (commands.size() != UnitCount || UnitCount < 2)
+	{
+		return false;
+	}
+	vector<bool> seen(UnitCount + 1, false);
+	for (const PSERIAL_PACKET& command : commands)
+	{
+		if (command.Command != commands[0].Command || command.Data != commands[0].Data
+			|| command.Unit == 0 || command.Unit > UnitCount || seen[command.Unit])
+		{
+			return false;
+		}
+		seen[command.Unit] = true;
+	}
+	return true;
+}
+
+vector<future<long>> ZaberAsync::RequestMany(const vector<PSERIAL_PACKET>& commands)
+{
+	vector<future<long>> replies;
+	for (const PSERIAL_PACKET& command : commands)
+	{
+		if (command.Unit == 0 || command.Unit > UnitCount)
+		{
+			throw out_of_range("Zaber unit " + to_string(command.Unit) + " is not in the chain");
+		}
+	}
+	for (const PSERIAL_PACKET& command : commands)
+	{
+		replies.push_back(Expect(command.Unit, command.Command, command.Data));
+	}
+	if (CoversChain(commands))
+	{
+		Port.Send(0, commands[0].Command, commands[0].Data);
+	}
+	else
+	{
+		Port.SendMany(commands.data(), (int)commands.size());
+	}
+	return replies;
+}
+
+vector<future<long>> ZaberAsync::Broadcast(unsigned char command, long data)
+{
+	vector<future<long>> replies;
+	for (unsigned char unit = 1; unit <= UnitCount; unit++)
+	{
+		replies.push_back(Expect(unit, command, data));
+	}
+	Port.Send(0, command, data);
+	return replies;
+}
+
+void ZaberAsync::Dispatch(const PSERIAL_PACKET& packet)
+{
+	if (packet.Unit >= 1 && packet.Unit <= UnitCount)
+	{
+		deque<Outstanding>& queue = Queues[packet.Unit];
+		for (auto it = queue.begin(); it != queue.end(); ++it)
+		{
+			if (packet.Command == ZABER_ERROR)
+			{
+				// Error replies do not say which command failed; charge
+				// the oldest request to that unit.
+				it->Reply.set_exception(make_exception_ptr(ZaberError(packet.Unit, packet.Data)));
+				queue.erase(it);
+				return;
+			}
+			if (it->Command == packet.Command)
+			{
+				it->Reply.set_value(packet.Data);
+				queue.erase(it);
+				return;
+			}
+		}
+	}
+	if (OnUnsolicited)
+	{
+		OnUnsolicited(packet);
+	}
+}
+
+int ZaberAsync::Pump(unsigned long timeoutMs)
+{
+	PSERIAL_PACKET packets[PUMP_BATCH];
+	int count = Port.Receive(packets, PUMP_BATCH, timeoutMs);
+	for (int i = 0; i < count; i++)
+	{
+		Dispatch(packets[i]);
+	}
+	return count;
+}
+
+void ZaberAsync::CancelAll()
+{
+	// Dropping the promises leaves broken_promise in their futures
+	for (deque<Outstanding>& queue : Queues)
+	{
+		queue.clear();
+	}
+}
+
+size_t ZaberAsync::Pending() const
+{
+	size_t count = 0;
+	for (const deque<Outstanding>& queue : Queues)
+	{
+		count += queue.size();
+	}
+	return count;
+}
@@ -0,0 +1,68 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERASYNC.H
+ Project:       StepperMotor
+ Description:   Asynchronous command/reply correlation for daisy-chained
+                Zaber units on one ZaberChannel, binary protocol.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERASYNC_H_
+#define _ZABERASYNC_H_
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "zaberchannel.h"
+#include "zaberlink.h"
+
+// Replies are matched to the oldest outstanding request with the same
+// (Unit, Command), so requests to different units can be in flight
+// together and complete in whatever order the chain answers.
+class ZaberAsync : public ZaberLink
+{
+public:
+	explicit ZaberAsync(ZaberChannel& port);
+	~ZaberAsync();
+
+	ZaberAsync(const ZaberAsync&) = delete;
+	ZaberAsync& operator=(const ZaberAsync&) = delete;
+
+	std::future<long> Request(unsigned char unit, unsigned char command, long data) override;
+
+	// When the commands address every unit in the chain with the same
+	// command and data, a single broadcast to unit 0 is sent instead.
+	std::vector<std::future<long>> RequestMany(const std::vector<PSERIAL_PACKET>& commands) override;
+
+	// Sends to unit 0 and expects one reply from every unit in the chain
+	std::vector<std::future<long>> Broadcast(unsigned char command, long data) override;
+
+	int Pump(unsigned long timeoutMs) override;
+
+	void CancelAll() override;
+
+	size_t Pending() const override;
+
+	unsigned char Units() const override { return UnitCount; }
+
+	// Called for packets that match no outstanding request (move
+	// tracking, manual moves, late replies after CancelAll).
+	std::function<void(const PSERIAL_PACKET&)> OnUnsolicited;
+
+private:
+	struct Outstanding
+	{
+		unsigned char Command;
+		std::promise<long> Reply;
+	};
+
+	void Dispatch(const PSERIAL_PACKET& packet);
+	bool CoversChain(const std::vector<PSERIAL_PACKET>& commands) const;
+	std::future<long> Expect(unsigned char unit, unsigned char command, long data);
+
+	ZaberChannel& Port;
+	unsigned char UnitCount;
+	std::vector<std::deque<Outstanding>> Queues; // indexed by unit
+};
+
+#endif
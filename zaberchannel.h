@@ -0,0 +1,32 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERCHANNEL.H
+ Project:       StepperMotor
+ Description:   Transport interface under the protocol engines.  A
+                ZaberPort does the I/O on the calling thread; a
+                ZaberIoThread hands it to a dedicated serial thread.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERCHANNEL_H_
+#define _ZABERCHANNEL_H_
+
+#include "pserial.h"
+
+class ZaberChannel
+{
+public:
+	virtual ~ZaberChannel() {}
+
+	// Binary protocol packets
+	virtual void Send(unsigned char unit, unsigned char command, long data) = 0;
+	virtual void SendMany(const PSERIAL_PACKET* packets, int count) = 0;
+	virtual int Receive(PSERIAL_PACKET* packets, int maxPackets, unsigned long timeoutMs) = 0;
+
+	// Unframed byte I/O for the ASCII protocol
+	virtual unsigned long ReadRaw(unsigned char* buffer, unsigned long maxBytes, unsigned long timeoutMs) = 0;
+	virtual unsigned long WriteRaw(const unsigned char* bytes, unsigned long count) = 0;
+
+	virtual unsigned char Units() const = 0;
+};
+
+#endif
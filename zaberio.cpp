@@ -0,0 +1,150 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERIO.CPP
+ Project:       StepperMotor
+ Description:   Dedicated serial I/O thread for one ZaberPort.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <chrono>
+
+#include "zaberio.h"
+
+using namespace std;
+
+#define IO_IDLE_MS    1000 // longest port wait; data, a send or Stop end it early
+#define IO_CHUNK      256  // bytes moved per raw read or write
+#define PARK_MS       1000 // re-check interval for waits with no deadline
+
+ZaberIoThread::ZaberIoThread(ZaberPort& port, bool rawBytes)
+	: Port(port), Raw(rawBytes), Running(true), Dropped(0)
+{
+	Worker = thread(&ZaberIoThread::Run, this);
+}
+
+ZaberIoThread::~ZaberIoThread()
+{
+	Stop();
+}
+
+void ZaberIoThread::Stop()
+{
+	Running.store(false, memory_order_release);
+	Port.Wake();
+	if (Worker.joinable())
+	{
+		Worker.join();
+	}
+}
+
+void ZaberIoThread::Run()
+{
+	// Keep going after Stop until the transmit queues are flushed
+	while (Running.load(memory_order_acquire) || !TxPackets.Empty() || !TxBytes.Empty())
+	{
+		if (Raw)
+		{
+			PumpBytes();
+		}
+		else
+		{
+			PumpPackets();
+		}
+	}
+}
+
+void ZaberIoThread::PumpPackets()
+{
+	PSERIAL_PACKET packets[PSERIAL_MAXBATCH];
+	size_t count = TxPackets.PopMany(packets, PSERIAL_MAXBATCH);
+	if (count > 0)
+	{
+		TxRoom.Wake();
+		Port.SendMany(packets, (int)count);
+	}
+	// Waiting here is the idle sleep; a send wakes it, and there is no
+	// wait with more to send
+	int received = Port.Receive(packets, PSERIAL_MAXBATCH, TxPackets.Empty() ? IO_IDLE_MS : 0);
+	if (received > 0)
+	{
+		if (!RxPackets.PushMany(packets, (size_t)received))
+		{
+			Dropped.fetch_add((unsigned long)received, memory_order_relaxed);
+		}
+		RxReady.Wake();
+	}
+}
+
+void ZaberIoThread::PumpBytes()
+{
+	unsigned char chunk[IO_CHUNK];
+	size_t count = TxBytes.PopMany(chunk, IO_CHUNK);
+	if (count > 0)
+	{
+		TxRoom.Wake();
+		Port.WriteRaw(chunk, (unsigned long)count);
+	}
+	unsigned long received = Port.ReadRaw(chunk, IO_CHUNK, TxBytes.Empty() ? IO_IDLE_MS : 0);
+	if (received > 0)
+	{
+		if (!RxBytes.PushMany(chunk, received))
+		{
+			Dropped.fetch_add(received, memory_order_relaxed);
+		}
+		RxReady.Wake();
+	}
+}
+
+void ZaberIoThread::Send(unsigned char unit, unsigned char command, long data)
+{
+	PSERIAL_PACKET packet = {unit, command, data};
+	SendMany(&packet, 1);
+}
+
+void ZaberIoThread::SendMany(const PSERIAL_PACKET* packets, int count)
+{
+	// A batch is queued whole so the I/O thread writes it in one go;
+	// the queue drains at line rate, so waiting for room is short.
+	while (count > 0)
+	{
+		int batch = count < PSERIAL_MAXBATCH ? count : PSERIAL_MAXBATCH;
+		auto pushed = [&] { return TxPackets.PushMany(packets, (size_t)batch); };
+		while (!TxRoom.WaitUntil(pushed, chrono::steady_clock::now() + chrono::milliseconds(PARK_MS)))
+		{
+		}
+		Port.Wake();
+		packets += batch;
+		count -= batch;
+	}
+}
+
+int ZaberIoThread::Receive(PSERIAL_PACKET* packets, int maxPackets, unsigned long timeoutMs)
+{
+	size_t count = 0;
+	RxReady.WaitUntil([&] { return (count = RxPackets.PopMany(packets, (size_t)maxPackets)) > 0; },
+		chrono::steady_clock::now() + chrono::milliseconds(timeoutMs));
+	return (int)count;
+}
+
+unsigned long ZaberIoThread::ReadRaw(unsigned char* buffer, unsigned long maxBytes, unsigned long timeoutMs)
+{
+	size_t count = 0;
+	RxReady.WaitUntil([&] { return (count = RxBytes.PopMany(buffer, maxBytes)) > 0; },
+		chrono::steady_clock::now() + chrono::milliseconds(timeoutMs));
+	return (unsigned long)count;
+}
+
+unsigned long ZaberIoThread::WriteRaw(const unsigned char* bytes, unsigned long count)
+{
+	unsigned long written = 0;
+	while (written < count)
+	{
+		unsigned long chunk = count - written < IO_CHUNK ? count - written : IO_CHUNK;
+		auto pushed = [&] { return TxBytes.PushMany(bytes + written, chunk); };
+		while (!TxRoom.WaitUntil(pushed, chrono::steady_clock::now() + chrono::milliseconds(PARK_MS)))
+		{
+		}
+		Port.Wake();
+		written += chunk;
+	}
+	return written;
+}
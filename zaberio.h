@@ -0,0 +1,114 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERIO.H
+ Project:       StepperMotor
+ Description:   Dedicated serial I/O thread for one ZaberPort.  The
+                scan thread exchanges packets (or raw bytes for the
+                ASCII protocol) with it through lock-free SPSC queues,
+                so slow instrument calls on the scan thread no longer
+                hold up serial reads and writes.  Both threads sleep
+                while the link is idle: the I/O thread in the port wait,
+                the scan thread on a condition variable.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERIO_H_
+#define _ZABERIO_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "spscqueue.h"
+#include "zaberchannel.h"
+#include "zaberport.h"
+
+#define ZABERIO_PACKETQUEUE 256  // packets each way
+#define ZABERIO_BYTEQUEUE   4096 // ASCII bytes each way
+
+// The thread owns the port from construction until Stop (or the
+// destructor); nothing else may touch the port in between.  Exactly one
+// other thread may use the ZaberChannel methods.
+class ZaberIoThread : public ZaberChannel
+{
+public:
+	// rawBytes selects ASCII byte transport instead of decoded packets
+	ZaberIoThread(ZaberPort& port, bool rawBytes);
+	~ZaberIoThread();
+
+	ZaberIoThread(const ZaberIoThread&) = delete;
+	ZaberIoThread& operator=(const ZaberIoThread&) = delete;
+
+	// Writes out anything still queued for transmit, then joins
+	void Stop();
+
+	void Send(unsigned char unit, unsigned char command, long data) override;
+	void SendMany(const PSERIAL_PACKET* packets, int count) override;
+	int Receive(PSERIAL_PACKET* packets, int maxPackets, unsigned long timeoutMs) override;
+
+	unsigned long ReadRaw(unsigned char* buffer, unsigned long maxBytes, unsigned long timeoutMs) override;
+	unsigned long WriteRaw(const unsigned char* bytes, unsigned long count) override;
+
+	unsigned char Units() const override { return Port.Units(); }
+
+	// Received data lost because the scan thread fell behind
+	unsigned long Overruns() const { return Dropped.load(std::memory_order_relaxed); }
+
+private:
+	// Puts one thread to sleep until another has made ready() true.
+	// Wake costs an atomic load unless a thread is parked.
+	class Parking
+	{
+	public:
+		template <typename Ready>
+		bool WaitUntil(Ready ready, std::chrono::steady_clock::time_point deadline)
+		{
+			if (ready())
+			{
+				return true;
+			}
+			std::unique_lock<std::mutex> lock(Lock);
+			Parked.store(true);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			bool result = Signal.wait_until(lock, deadline, ready);
+			Parked.store(false);
+			return result;
+		}
+
+		void Wake()
+		{
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (Parked.load())
+			{
+				{
+					std::lock_guard<std::mutex> lock(Lock);
+				}
+				Signal.notify_one();
+			}
+		}
+
+	private:
+		std::mutex Lock;
+		std::condition_variable Signal;
+		std::atomic<bool> Parked{false};
+	};
+
+	void Run();
+	void PumpPackets();
+	void PumpBytes();
+
+	ZaberPort& Port;
+	bool Raw;
+	std::atomic<bool> Running;
+	std::atomic<unsigned long> Dropped;
+	SpscQueue<PSERIAL_PACKET, ZABERIO_PACKETQUEUE> TxPackets;
+	SpscQueue<PSERIAL_PACKET, ZABERIO_PACKETQUEUE> RxPackets;
+	SpscQueue<unsigned char, ZABERIO_BYTEQUEUE> TxBytes;
+	SpscQueue<unsigned char, ZABERIO_BYTEQUEUE> RxBytes;
+	Parking RxReady; // scan thread waiting for received data
+	Parking TxRoom;  // scan thread waiting for transmit queue space
+	std::thread Worker;
+};
+
+#endif
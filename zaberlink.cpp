@@ -0,0 +1,57 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERLINK.CPP
+ Project:       StepperMotor
+ Description:   Protocol-independent request/reply interface to a chain
+                of Zaber units.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <chrono>
+
+#include "zaberlink.h"
+
+using namespace std;
+
+ZaberError::ZaberError(unsigned char unit, long code)
+	: runtime_error("Zaber unit " + to_string(unit) + " replied with error " + to_string(code)),
+	  Unit(unit), Code(code)
+{
+}
+
+ZaberError::ZaberError(unsigned char unit, const string& reason)
+	: runtime_error("Zaber unit " + to_string(unit) + " rejected the command: " + reason),
+	  Unit(unit), Code(-1)
+{
+}
+
+bool ZaberLink::Await(future<long>& reply, unsigned long timeoutMs)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	while (reply.wait_for(chrono::seconds(0)) != future_status::ready)
+	{
+		auto now = chrono::steady_clock::now();
+		if (now >= deadline)
+		{
+			return false;
+		}
+		Pump((unsigned long)chrono::duration_cast<chrono::milliseconds>(deadline - now).count() + 1);
+	}
+	return true;
+}
+
+bool ZaberLink::AwaitAll(vector<future<long>>& replies, unsigned long timeoutMs)
+{
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	for (future<long>& reply : replies)
+	{
+		auto now = chrono::steady_clock::now();
+		unsigned long remaining = now < deadline
+			? (unsigned long)chrono::duration_cast<chrono::milliseconds>(deadline - now).count()
+			: 0;
+		if (!Await(reply, remaining))
+		{
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,85 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERLINK.H
+ Project:       StepperMotor
+ Description:   Protocol-independent request/reply interface to a chain
+                of Zaber units.  Commands are expressed with the binary
+                protocol's command numbers; ZaberAsync sends them as
+                6-byte packets and ZaberAscii translates them to the
+                ASCII protocol.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERLINK_H_
+#define _ZABERLINK_H_
+
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pserial.h"
+
+// Zaber binary command numbers used by the project
+#define ZABER_HOME            1
+#define ZABER_RENUMBER        2
+#define ZABER_MOVEABSOLUTE    20
+#define ZABER_MOVERELATIVE    21
+#define ZABER_STOP            23
+#define ZABER_SETTARGETSPEED  42
+#define ZABER_SETACCELERATION 43
+#define ZABER_RETURNSETTING   53
+#define ZABER_RETURNPOS       60
+#define ZABER_ERROR           255
+
+// Speed data (target speed, ASCII maxspeed) per microstep/s, and
+// acceleration data (ASCII accel) per microstep/s^2
+#define ZABER_SPEEDSCALE      1.6384
+#define ZABER_ACCELSCALE      1.6384e-4
+
+// Raised through a request's future when the unit rejects a command.
+// Code is the binary error number, or -1 for an ASCII rejection whose
+// reason is in the message.
+class ZaberError : public std::runtime_error
+{
+public:
+	ZaberError(unsigned char unit, long code);
+	ZaberError(unsigned char unit, const std::string& reason);
+	unsigned char Unit;
+	long Code;
+};
+
+// Every request gets a future for the Data of its reply.  Motion
+// commands (home, move absolute/relative) resolve when the move has
+// finished, with the position the unit stopped at.
+class ZaberLink
+{
+public:
+	virtual ~ZaberLink() = default;
+
+	virtual std::future<long> Request(unsigned char unit, unsigned char command, long data) = 0;
+
+	// Sends all commands in one write where the protocol allows.
+	// Futures are returned in command order.
+	virtual std::vector<std::future<long>> RequestMany(const std::vector<PSERIAL_PACKET>& commands) = 0;
+
+	// Addresses every unit at once and expects one reply from each
+	virtual std::vector<std::future<long>> Broadcast(unsigned char command, long data) = 0;
+
+	// Receives whatever has arrived (waiting up to timeoutMs for the
+	// first data) and dispatches it.  Returns the messages handled.
+	virtual int Pump(unsigned long timeoutMs) = 0;
+
+	// Fails every outstanding request, e.g. after a timeout, so late
+	// replies are not credited to the next request.
+	virtual void CancelAll() = 0;
+
+	virtual size_t Pending() const = 0;
+
+	virtual unsigned char Units() const = 0;
+
+	// Pumps until the future is ready or timeoutMs elapses
+	bool Await(std::future<long>& reply, unsigned long timeoutMs);
+	bool AwaitAll(std::vector<std::future<long>>& replies, unsigned long timeoutMs);
+};
+
+#endif
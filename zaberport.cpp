@@ -0,0 +1,115 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERPORT.CPP
+ Project:       StepperMotor
+ Description:   Owning wrapper around a PSERIAL_PORT.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#include <new>
+#include <utility>
+
+#include "zaberport.h"
+
+using namespace std;
+
+ZaberPort::ZaberPort(unsigned char units)
+	: Port(PSERIAL_PortCreate(units)), Capture(nullptr), UnitCount(units)
+{
+	if (Port == nullptr)
+	{
+		throw bad_alloc();
+	}
+}
+
+ZaberPort::~ZaberPort()
+{
+	PSERIAL_PortDestroy(Port);
+	PCAPTURE_Close(Capture);
+}
+
+ZaberPort::ZaberPort(ZaberPort&& other) noexcept
+	: Port(other.Port), Capture(other.Capture), UnitCount(other.UnitCount), PortName(move(other.PortName))
+{
+	other.Port = nullptr;
+	other.Capture = nullptr;
+}
+
+ZaberPort& ZaberPort::operator=(ZaberPort&& other) noexcept
+{
+	if (this != &other)
+	{
+		PSERIAL_PortDestroy(Port);
+		PCAPTURE_Close(Capture);
+		Port = other.Port;
+		Capture = other.Capture;
+		UnitCount = other.UnitCount;
+		PortName = move(other.PortName);
+		other.Port = nullptr;
+		other.Capture = nullptr;
+	}
+	return *this;
+}
+
+bool ZaberPort::Open(const string& portName, unsigned long baud)
+{
+	PortName = portName;
+	return PSERIAL_PortOpenBaud(Port, portName.c_str(), baud) != 0;
+}
+
+void ZaberPort::Close()
+{
+	if (Port != nullptr)
+	{
+		PSERIAL_PortClose(Port);
+	}
+}
+
+bool ZaberPort::IsOpen() const
+{
+	return Port != nullptr && PSERIAL_PortIsOpen(Port);
+}
+
+void ZaberPort::Send(unsigned char unit, unsigned char command, long data)
+{
+	PSERIAL_PortSend(Port, unit, command, data);
+}
+
+void ZaberPort::SendMany(const PSERIAL_PACKET* packets, int count)
+{
+	PSERIAL_PortSendMany(Port, packets, count);
+}
+
+int ZaberPort::Receive(PSERIAL_PACKET* packets, int maxPackets, unsigned long timeoutMs)
+{
+	return PSERIAL_PortReceiveMany(Port, packets, maxPackets, timeoutMs);
+}
+
+unsigned long ZaberPort::ReadRaw(unsigned char* buffer, unsigned long maxBytes, unsigned long timeoutMs)
+{
+	return PSERIAL_PortReadRaw(Port, buffer, maxBytes, timeoutMs);
+}
+
+unsigned long ZaberPort::WriteRaw(const unsigned char* bytes, unsigned long count)
+{
+	return PSERIAL_PortWriteRaw(Port, bytes, count);
+}
+
+void ZaberPort::Wake()
+{
+	PSERIAL_PortWake(Port);
+}
+
+bool ZaberPort::StartCapture(const string& fileName)
+{
+	StopCapture();
+	Capture = PCAPTURE_Create(fileName.c_str());
+	PSERIAL_PortSetCapture(Port, Capture);
+	return Capture != nullptr;
+}
+
+void ZaberPort::StopCapture()
+{
+	PSERIAL_PortSetCapture(Port, nullptr);
+	PCAPTURE_Close(Capture);
+	Capture = nullptr;
+}
@@ -0,0 +1,60 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERPORT.H
+ Project:       StepperMotor
+ Description:   Owning wrapper around a PSERIAL_PORT.  Each ZaberPort
+                has its own handle and receive state, so one process
+                can drive several daisy chains, one port per thread.
+                Language : C++17
+------------------------------------------------------------------------*/
+
+#ifndef _ZABERPORT_H_
+#define _ZABERPORT_H_
+
+#include <string>
+
+#include "pserial.h"
+#include "zaberchannel.h"
+
+class ZaberPort : public ZaberChannel
+{
+public:
+	explicit ZaberPort(unsigned char units);
+	~ZaberPort();
+
+	ZaberPort(const ZaberPort&) = delete;
+	ZaberPort& operator=(const ZaberPort&) = delete;
+	ZaberPort(ZaberPort&& other) noexcept;
+	ZaberPort& operator=(ZaberPort&& other) noexcept;
+
+	bool Open(const std::string& portName, unsigned long baud = 9600);
+	void Close();
+	bool IsOpen() const;
+
+	void Send(unsigned char unit, unsigned char command, long data) override;
+	void SendMany(const PSERIAL_PACKET* packets, int count) override;
+	int Receive(PSERIAL_PACKET* packets, int maxPackets, unsigned long timeoutMs) override;
+
+	// Unframed byte I/O for the ASCII protocol
+	unsigned long ReadRaw(unsigned char* buffer, unsigned long maxBytes, unsigned long timeoutMs) override;
+	unsigned long WriteRaw(const unsigned char* bytes, unsigned long count) override;
+
+	unsigned char Units() const override { return UnitCount; }
+	const std::string& Name() const { return PortName; }
+
+	// Ends a Receive or ReadRaw wait early, with nothing read.  Safe to
+	// call from any thread, even while another is using the port.
+	void Wake();
+
+	// Records all traffic to a capture file until StopCapture or
+	// destruction.  Not to be called while a ZaberIoThread owns the port.
+	bool StartCapture(const std::string& fileName);
+	void StopCapture();
+
+private:
+	PSERIAL_PORT* Port;
+	PCAPTURE* Capture;
+	unsigned char UnitCount;
+	std::string PortName;
+};
+
+#endif
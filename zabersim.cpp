@@ -0,0 +1,585 @@
+/*------------------------------------------------------------------------
+ Module:        ZABERSIM.CPP
+ Project:       StepperMotor
+ Description:   Pseudo-terminal simulator for a daisy chain of Zaber
+                stages speaking the 6-byte binary protocol, or the
+                ASCII protocol with message IDs and checksums.  Point
+                PSERIAL_Open at the printed device path to exercise
+                the serial code and scan timing without hardware.
+                Language : C++17
+                Platform : POSIX (Linux pty)
+------------------------------------------------------------------------*/
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pdecode.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Zaber binary command numbers emulated here
+#define CMD_HOME          1
+#define CMD_RENUMBER      2
+#define CMD_MOVEABS       20
+#define CMD_MOVEREL       21
+#define CMD_STOP          23
+#define CMD_SETSPEED      42
+#define CMD_SETACCEL      43
+#define CMD_RETURNSETTING 53
+#define CMD_ECHO          55
+#define CMD_RETURNPOS     60
+#define CMD_ERROR         255
+
+#define ERR_INVALID_COMMAND 64
+#define ERR_SETTING_INVALID 53
+
+#define SPEED_SCALE 1.6384    // speed data per microstep/s
+#define ACCEL_SCALE 1.6384e-4 // acceleration data per microstep/s^2
+
+struct SimConfig
+{
+	int units = 2;
+	double velocity = 9.4e6;    // microsteps/s; full X travel in ~0.86 s
+	double accel = 1.0e8;       // microsteps/s^2
+	double latencyMs = 2.0;     // firmware turnaround before a reply
+	long range = 8062992;       // microsteps of travel per unit
+	long baud = 9600;           // wire rate used to pace replies
+	bool ascii = false;         // speak the ASCII protocol instead of binary
+	string link;                // optional symlink to the pty slave
+};
+
+struct Axis
+{
+	double from = 0.0;
+	double to = 0.0;
+	Clock::time_point start;
+	double duration = 0.0;      // seconds
+	double velocity = 0.0;      // cruise speed of the current move
+	double accel = 0.0;         // and its acceleration
+	double speed = 0.0;         // target speed setting, microsteps/s
+	double acceleration = 0.0;  // acceleration setting, microsteps/s^2
+	unsigned long generation = 0;
+	bool alerts = false;        // ASCII comm.alert: announce IDLE after moves
+	bool checksums = false;     // ASCII comm.checksum: sign every message
+};
+
+struct Reply
+{
+	Clock::time_point due;
+	string bytes;
+	int unit;                   // axis a completion belongs to, or 0
+	unsigned long generation;   // completion is void if the axis moved on
+	bool operator>(const Reply &other) const { return due > other.due; }
+};
+
+static volatile sig_atomic_t Stop = 0;
+
+static void OnSignal(int)
+{
+	Stop = 1;
+}
+
+// Trapezoidal (or triangular) profile time for a move of length d
+static double MoveTime(double velocity, double accel, double d)
+{
+	d = fabs(d);
+	double rampDist = velocity * velocity / accel;
+	if (d <= rampDist)
+	{
+		return 2.0 * sqrt(d / accel);
+	}
+	return d / velocity + velocity / accel;
+}
+
+static double Position(const Axis &axis, Clock::time_point now)
+{
+	double t = chrono::duration<double>(now - axis.start).count();
+	if (t >= axis.duration)
+	{
+		return axis.to;
+	}
+	double d = fabs(axis.to - axis.from);
+	double dir = axis.to >= axis.from ? 1.0 : -1.0;
+	double peak = min(axis.velocity, sqrt(d * axis.accel));
+	double ramp = peak / axis.accel;
+	double travelled;
+	if (t < ramp)
+	{
+		travelled = 0.5 * axis.accel * t * t;
+	}
+	else if (t < axis.duration - ramp)
+	{
+		travelled = 0.5 * peak * ramp + peak * (t - ramp);
+	}
+	else
+	{
+		double left = axis.duration - t;
+		travelled = d - 0.5 * axis.accel * left * left;
+	}
+	return axis.from + dir * travelled;
+}
+
+static void Usage()
+{
+	cout << "Usage: zabersim [-units N] [-velocity steps/s] [-accel steps/s^2]" << endl;
+	cout << "                [-latency ms] [-range steps] [-baud rate] [-link path]" << endl;
+	cout << "                [-protocol binary|ascii]" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	SimConfig cfg;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			Usage();
+			return 1;
+		}
+		string value = argv[++i];
+		if (arg == "-units") cfg.units = stoi(value);
+		else if (arg == "-velocity") cfg.velocity = stod(value);
+		else if (arg == "-accel") cfg.accel = stod(value);
+		else if (arg == "-latency") cfg.latencyMs = stod(value);
+		else if (arg == "-range") cfg.range = stol(value);
+		else if (arg == "-baud") cfg.baud = stol(value);
+		else if (arg == "-link") cfg.link = value;
+		else if (arg == "-protocol" && (value == "binary" || value == "ascii")) cfg.ascii = value == "ascii";
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+	if (cfg.units < 1 || cfg.units > 254 || cfg.velocity <= 0 || cfg.accel <= 0 || cfg.baud <= 0)
+	{
+		cout << "Invalid simulator settings" << endl;
+		return 1;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+	{
+		cout << "Unable to create pseudo-terminal" << endl;
+		return 1;
+	}
+	string slaveName = ptsname(master);
+
+	// Hold the slave open in raw mode so the line discipline never
+	// echoes or translates packet bytes, and so the master does not
+	// see EIO between client sessions.
+	int slave = open(slaveName.c_str(), O_RDWR | O_NOCTTY);
+	struct termios tio;
+	tcgetattr(slave, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+
+	if (!cfg.link.empty())
+	{
+		unlink(cfg.link.c_str());
+		if (symlink(slaveName.c_str(), cfg.link.c_str()) != 0)
+		{
+			cout << "Unable to create link " << cfg.link << endl;
+		}
+	}
+	cout << "Simulating " << cfg.units << " Zaber unit(s) on " << slaveName << endl;
+
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+
+	vector<Axis> axes(cfg.units + 1);
+	for (Axis &axis : axes)
+	{
+		axis.start = Clock::now();
+		axis.speed = axis.velocity = cfg.velocity;
+		axis.acceleration = axis.accel = cfg.accel;
+	}
+	priority_queue<Reply, vector<Reply>, greater<Reply>> replies;
+	PDECODE_STATE rx;
+	PDECODE_Init(&rx, 254);
+	// Commands arrive from the host, so unit 0 and every command number
+	// are legal here; only the 6-byte framing matters.
+	rx.MinUnit = 0;
+	rx.MaxUnit = 255;
+	memset(rx.Commands, 0xFF, sizeof(rx.Commands));
+
+	auto latency = chrono::duration_cast<Clock::duration>(
+		chrono::duration<double, milli>(cfg.latencyMs));
+	Clock::time_point lineFree = Clock::now();
+	unsigned long commands = 0, moves = 0, sent = 0;
+	string rxText;
+
+	auto queueBytes = [&](Clock::time_point due, const string &bytes, int axis)
+	{
+		Reply reply;
+		reply.due = due;
+		reply.bytes = bytes;
+		reply.unit = axis;
+		reply.generation = axis ? axes[axis].generation : 0;
+		replies.push(reply);
+	};
+
+	auto binaryPacket = [](int unit, unsigned char command, long data)
+	{
+		unsigned long raw = (unsigned long)data;
+		string bytes(PSERIAL_PACKETSIZE, '\0');
+		bytes[0] = (char)unit;
+		bytes[1] = (char)command;
+		bytes[2] = (char)(raw & 0xFF);
+		bytes[3] = (char)((raw >> 8) & 0xFF);
+		bytes[4] = (char)((raw >> 16) & 0xFF);
+		bytes[5] = (char)((raw >> 24) & 0xFF);
+		return bytes;
+	};
+
+	// ASCII message, e.g. "@01 0 12 OK IDLE -- 0\r\n", or with comm.checksum
+	// set "@01 0 12 OK IDLE -- 0:9C\r\n"
+	auto asciiLine = [](char type, const string &body, bool checksummed)
+	{
+		if (!checksummed)
+		{
+			return string(1, type) + body + "\r\n";
+		}
+		unsigned int sum = 0;
+		for (unsigned char c : body)
+		{
+			sum += c;
+		}
+		char checksum[8];
+		snprintf(checksum, sizeof(checksum), ":%02X\r\n", (256 - (sum & 0xFF)) & 0xFF);
+		return string(1, type) + body + checksum;
+	};
+
+	auto startMove = [&](int unit, double target, unsigned char command, Clock::time_point now)
+	{
+		Axis &axis = axes[unit];
+		target = max(0.0, min((double)cfg.range, target));
+		axis.from = Position(axis, now);
+		axis.to = target;
+		axis.start = now;
+		axis.velocity = axis.speed;
+		axis.accel = axis.acceleration;
+		axis.duration = MoveTime(axis.velocity, axis.accel, target - axis.from);
+		axis.generation++;
+		moves++;
+		auto done = now + chrono::duration_cast<Clock::duration>(chrono::duration<double>(axis.duration));
+		if (!cfg.ascii)
+		{
+			queueBytes(done + latency, binaryPacket(unit, command, lround(target)), unit);
+		}
+		else if (axis.alerts)
+		{
+			char body[32];
+			snprintf(body, sizeof(body), "%02d 0 IDLE --", unit);
+			queueBytes(done + latency, asciiLine('!', body, axis.checksums), unit);
+		}
+	};
+
+	auto executeBinary = [&](int unit, const PSERIAL_PACKET &packet, Clock::time_point now)
+	{
+		Axis &axis = axes[unit];
+		long pos = lround(Position(axis, now));
+		switch (packet.Command)
+		{
+		case CMD_HOME:
+			startMove(unit, 0.0, CMD_HOME, now);
+			break;
+		case CMD_RENUMBER:
+			// Chain order already defines the numbering
+			queueBytes(now + latency, binaryPacket(unit, CMD_RENUMBER, unit), 0);
+			break;
+		case CMD_MOVEABS:
+			startMove(unit, (double)packet.Data, CMD_MOVEABS, now);
+			break;
+		case CMD_MOVEREL:
+			startMove(unit, (double)pos + packet.Data, CMD_MOVEREL, now);
+			break;
+		case CMD_STOP:
+			axis.from = axis.to = pos;
+			axis.duration = 0.0;
+			axis.generation++;
+			queueBytes(now + latency, binaryPacket(unit, CMD_STOP, pos), 0);
+			break;
+		case CMD_SETSPEED:
+			// Takes effect from the next move, as on the drives
+			axis.speed = packet.Data > 0 ? packet.Data / SPEED_SCALE : cfg.velocity;
+			queueBytes(now + latency, binaryPacket(unit, CMD_SETSPEED, packet.Data), 0);
+			break;
+		case CMD_SETACCEL:
+			axis.acceleration = packet.Data > 0 ? packet.Data / ACCEL_SCALE : cfg.accel;
+			queueBytes(now + latency, binaryPacket(unit, CMD_SETACCEL, packet.Data), 0);
+			break;
+		case CMD_ECHO:
+			queueBytes(now + latency, binaryPacket(unit, CMD_ECHO, packet.Data), 0);
+			break;
+		case CMD_RETURNSETTING:
+			if (packet.Data == CMD_SETSPEED)
+			{
+				queueBytes(now + latency, binaryPacket(unit, CMD_SETSPEED, lround(axis.speed * SPEED_SCALE)), 0);
+			}
+			else if (packet.Data == CMD_SETACCEL)
+			{
+				queueBytes(now + latency, binaryPacket(unit, CMD_SETACCEL, lround(axis.acceleration * ACCEL_SCALE)), 0);
+			}
+			else
+			{
+				queueBytes(now + latency, binaryPacket(unit, CMD_ERROR, ERR_SETTING_INVALID), 0);
+			}
+			break;
+		case CMD_RETURNPOS:
+			queueBytes(now + latency, binaryPacket(unit, CMD_RETURNPOS, pos), 0);
+			break;
+		default:
+			queueBytes(now + latency, binaryPacket(unit, CMD_ERROR, ERR_INVALID_COMMAND), 0);
+			break;
+		}
+	};
+
+	// "/1 0 12 move abs 1000:CS" -> "@01 0 12 OK BUSY -- 0:CS"
+	auto executeAscii = [&](int unit, int axisNumber, const string &id, const string &command,
+		const vector<string> &args, Clock::time_point now)
+	{
+		Axis &axis = axes[unit];
+		long pos = lround(Position(axis, now));
+		string flag = "OK";
+		string data = "0";
+		if (command == "home")
+		{
+			startMove(unit, 0.0, CMD_HOME, now);
+		}
+		else if (command == "stop")
+		{
+			axis.from = axis.to = pos;
+			axis.duration = 0.0;
+			axis.generation++;
+		}
+		else if (command == "renumber")
+		{
+			// Chain order already defines the numbering
+		}
+		else if (command == "move" && args.size() == 2 && (args[0] == "abs" || args[0] == "rel"))
+		{
+			long distance = atol(args[1].c_str());
+			startMove(unit, args[0] == "abs" ? (double)distance : (double)pos + distance, CMD_MOVEABS, now);
+		}
+		else if (command == "get" && !args.empty() && args[0] == "pos")
+		{
+			data = to_string(pos);
+		}
+		else if (command == "get" && !args.empty() && args[0] == "maxspeed")
+		{
+			data = to_string(lround(axis.speed * SPEED_SCALE));
+		}
+		else if (command == "get" && !args.empty() && args[0] == "accel")
+		{
+			data = to_string(lround(axis.acceleration * ACCEL_SCALE));
+		}
+		else if (command == "set" && args.size() == 2)
+		{
+			if (args[0] == "comm.alert")
+			{
+				axis.alerts = atol(args[1].c_str()) != 0;
+			}
+			else if (args[0] == "comm.checksum")
+			{
+				axis.checksums = atol(args[1].c_str()) != 0;
+			}
+			else if (args[0] == "maxspeed" && atol(args[1].c_str()) > 0)
+			{
+				axis.speed = atol(args[1].c_str()) / SPEED_SCALE;
+			}
+			else if (args[0] == "accel" && atol(args[1].c_str()) > 0)
+			{
+				axis.acceleration = atol(args[1].c_str()) / ACCEL_SCALE;
+			}
+		}
+		else
+		{
+			flag = "RJ";
+			data = "BADCOMMAND";
+		}
+		bool busy = chrono::duration<double>(Clock::now() - axis.start).count() < axis.duration;
+		char body[96];
+		snprintf(body, sizeof(body), "%02d %d %s%s%s %s --",
+			unit, axisNumber, id.c_str(), id.empty() ? "" : " ", flag.c_str(), busy ? "BUSY" : "IDLE");
+		queueBytes(now + latency, asciiLine('@', string(body) + " " + data, axis.checksums), 0);
+	};
+
+	auto receiveAscii = [&](const string &line, Clock::time_point now)
+	{
+		// Strip and check an optional checksum; bad lines are ignored as
+		// a real device would.
+		string text = line;
+		size_t colon = text.rfind(':');
+		if (colon != string::npos && colon + 3 == text.size())
+		{
+			unsigned int sum = strtoul(text.substr(colon + 1).c_str(), nullptr, 16);
+			for (size_t i = 1; i < colon; i++)
+			{
+				sum += (unsigned char)text[i];
+			}
+			if ((sum & 0xFF) != 0)
+			{
+				return;
+			}
+			text = text.substr(0, colon);
+		}
+		if (text.empty() || text[0] != '/')
+		{
+			return;
+		}
+		vector<string> words;
+		istringstream fields(text.substr(1));
+		for (string word; fields >> word; )
+		{
+			words.push_back(word);
+		}
+		// Leading numbers are device, axis and message ID, each optional
+		vector<long> address;
+		size_t w = 0;
+		while (w < words.size() && address.size() < 3 && isdigit((unsigned char)words[w][0]))
+		{
+			address.push_back(atol(words[w++].c_str()));
+		}
+		if (w >= words.size())
+		{
+			return;
+		}
+		int device = address.size() > 0 ? (int)address[0] : 0;
+		int axisNumber = address.size() > 1 ? (int)address[1] : 0;
+		string id = address.size() > 2 ? to_string(address[2]) : "";
+		string command = words[w++];
+		vector<string> args(words.begin() + w, words.end());
+		commands++;
+		for (int unit = 1; unit <= cfg.units; unit++)
+		{
+			if (device == 0 || device == unit)
+			{
+				executeAscii(unit, axisNumber, id, command, args, now);
+			}
+		}
+	};
+
+	while (!Stop)
+	{
+		Clock::time_point now = Clock::now();
+
+		// Transmit every reply that is due, paced at the wire rate
+		while (!replies.empty() && replies.top().due <= now)
+		{
+			Reply reply = replies.top();
+			replies.pop();
+			if (reply.unit && reply.generation != axes[reply.unit].generation)
+			{
+				continue; // superseded by a later move or stop
+			}
+			if (lineFree > now)
+			{
+				reply.due = lineFree;
+				replies.push(reply);
+				break;
+			}
+			if (write(master, reply.bytes.data(), reply.bytes.size()) == (ssize_t)reply.bytes.size())
+			{
+				sent++;
+			}
+			lineFree = now + chrono::duration_cast<Clock::duration>(
+				chrono::duration<double>(reply.bytes.size() * 10.0 / cfg.baud));
+		}
+
+		int waitMs = 1000;
+		if (!replies.empty())
+		{
+			auto wait = chrono::duration_cast<chrono::milliseconds>(replies.top().due - now).count();
+			waitMs = (int)max<long long>(0, min<long long>(wait + 1, 1000));
+		}
+
+		struct pollfd pfd;
+		pfd.fd = master;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, waitMs) <= 0 || !(pfd.revents & POLLIN))
+		{
+			continue;
+		}
+
+		now = Clock::now();
+		if (cfg.ascii)
+		{
+			char chunk[256];
+			ssize_t count = read(master, chunk, sizeof(chunk));
+			if (count <= 0)
+			{
+				continue;
+			}
+			rxText.append(chunk, (size_t)count);
+			size_t end;
+			while ((end = rxText.find_first_of("\r\n")) != string::npos)
+			{
+				string line = rxText.substr(0, end);
+				rxText.erase(0, end + 1);
+				receiveAscii(line, now);
+			}
+			continue;
+		}
+
+		unsigned char *span;
+		unsigned int spanSize = PDECODE_WriteSpan(&rx, &span);
+		ssize_t count = read(master, span, spanSize);
+		if (count <= 0)
+		{
+			continue;
+		}
+		PDECODE_Commit(&rx, (unsigned int)count);
+
+		PSERIAL_PACKET packet;
+		while (PDECODE_Next(&rx, &packet))
+		{
+			commands++;
+			if (packet.Unit == 0)
+			{
+				for (int unit = 1; unit <= cfg.units; unit++)
+				{
+					executeBinary(unit, packet, now);
+				}
+			}
+			else if (packet.Unit <= cfg.units)
+			{
+				executeBinary(packet.Unit, packet, now);
+			}
+		}
+	}
+
+	cout << endl << "Commands received: " << commands << endl;
+	cout << "Moves executed:    " << moves << endl;
+	cout << "Replies sent:      " << sent << endl;
+	if (!cfg.link.empty())
+	{
+		unlink(cfg.link.c_str());
+	}
+	close(slave);
+	close(master);
+	return 0;
+}
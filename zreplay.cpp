@@ -0,0 +1,267 @@
+/*------------------------------------------------------------------------
+ Module:        ZREPLAY.CPP
+ Project:       StepperMotor
+ Description:   Replays a serial capture written by PCAPTURE.C.  Received
+                bytes are fed back through the PDECODE framer in their
+                original chunks, at the captured pace or scaled by a
+                speed factor, and command-to-reply latencies are
+                reported.  Partial packets expire on the captured
+                timestamps, so the decoded stream is the same at every
+                speed; speed 0 runs flat out to benchmark the decoder.
+                Language : C++17
+                Platform : Any
+------------------------------------------------------------------------*/
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "pdecode.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+#define RXTIMEOUT_NS 500000000ULL // Same expiry as RXTIMEOUT in pserial.c
+
+struct ReplayConfig
+{
+	string file;
+	double speed = 1.0;  // 2 = twice as fast, 0 = no pacing
+	int units = 2;
+	bool ascii = false;  // print text lines instead of decoding packets
+	bool quiet = false;  // summary only
+};
+
+struct LatencyStats
+{
+	unsigned long count = 0;
+	double totalMs = 0.0;
+	double maxMs = 0.0;
+	unsigned long unmatched = 0;
+};
+
+static void Usage()
+{
+	cout << "Usage: zreplay capture.zcap [-speed factor] [-units N] [-protocol binary|ascii]" << endl;
+	cout << "                            [-quiet 1]" << endl;
+}
+
+static void PrintPacket(double ms, const char* direction, const PSERIAL_PACKET& packet)
+{
+	cout << fixed << setprecision(3) << setw(12) << ms << " ms  " << direction
+		<< "  unit " << setw(3) << (int)packet.Unit
+		<< "  cmd " << setw(3) << (int)packet.Command
+		<< "  data " << packet.Data;
+}
+
+static void PrintText(double ms, const char* direction, string& pending, const PCAPTURE_RECORD& record)
+{
+	pending.append((const char*)record.Bytes, record.Length);
+	size_t end;
+	while ((end = pending.find('\n')) != string::npos)
+	{
+		string line = pending.substr(0, end);
+		pending.erase(0, end + 1);
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+		cout << fixed << setprecision(3) << setw(12) << ms << " ms  " << direction << "  " << line << endl;
+	}
+}
+
+// Pushes a record through the framer, handing out packets as they complete
+template <typename Handler>
+static void Decode(PDECODE_STATE& state, const PCAPTURE_RECORD& record, Handler handle)
+{
+	PSERIAL_PACKET packet;
+	unsigned int offset = 0;
+	while (offset < record.Length)
+	{
+		offset += PDECODE_Push(&state, record.Bytes + offset, record.Length - offset);
+		while (PDECODE_Next(&state, &packet))
+		{
+			handle(packet);
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	ReplayConfig cfg;
+	if (argc < 2)
+	{
+		Usage();
+		return 1;
+	}
+	cfg.file = argv[1];
+	for (int i = 2; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			Usage();
+			return 1;
+		}
+		string value = argv[++i];
+		if (arg == "-speed") cfg.speed = stod(value);
+		else if (arg == "-units") cfg.units = stoi(value);
+		else if (arg == "-protocol" && (value == "binary" || value == "ascii")) cfg.ascii = value == "ascii";
+		else if (arg == "-quiet") cfg.quiet = stoi(value) != 0;
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+	if (cfg.units < 1 || cfg.units > 254 || cfg.speed < 0)
+	{
+		cout << "Invalid replay settings" << endl;
+		return 1;
+	}
+
+	PCAPTURE* capture = PCAPTURE_Open(cfg.file.c_str());
+	if (capture == nullptr)
+	{
+		cout << "Unable to read capture " << cfg.file << endl;
+		return 1;
+	}
+
+	// Host side sees replies; the transmit side is decoded as the
+	// simulator would, accepting any unit and command.
+	PDECODE_STATE rx, tx;
+	PDECODE_Init(&rx, (unsigned char)cfg.units);
+	PDECODE_Init(&tx, 255);
+	tx.MinUnit = 0;
+	for (int command = 0; command < 256; command++)
+	{
+		PDECODE_AllowCommand(&tx, (unsigned char)command);
+	}
+
+	map<pair<int, int>, deque<unsigned long long>> sentAt; // (unit, command)
+	map<int, LatencyStats> latency;                        // by command
+	unsigned long records = 0, txPackets = 0, rxPackets = 0, rxBytes = 0;
+	unsigned long long firstNs = 0, lastNs = 0, lastRxNs = 0;
+	string txText, rxText;
+	PCAPTURE_RECORD record;
+	Clock::time_point start = Clock::now();
+
+	while (PCAPTURE_Read(capture, &record))
+	{
+		if (records++ == 0)
+		{
+			firstNs = lastRxNs = record.Nanoseconds;
+		}
+		lastNs = record.Nanoseconds;
+		double ms = (record.Nanoseconds - firstNs) / 1e6;
+		if (cfg.speed > 0)
+		{
+			this_thread::sleep_until(start + chrono::duration_cast<Clock::duration>(
+				chrono::duration<double, milli>(ms / cfg.speed)));
+		}
+
+		if (record.Direction == PCAPTURE_TX)
+		{
+			if (cfg.ascii)
+			{
+				if (!cfg.quiet) PrintText(ms, "TX", txText, record);
+				continue;
+			}
+			Decode(tx, record, [&](const PSERIAL_PACKET& packet)
+			{
+				txPackets++;
+				int first = packet.Unit ? packet.Unit : 1;
+				int last = packet.Unit ? packet.Unit : cfg.units;
+				for (int unit = first; unit <= last; unit++)
+				{
+					sentAt[make_pair(unit, (int)packet.Command)].push_back(record.Nanoseconds);
+				}
+				if (!cfg.quiet)
+				{
+					PrintPacket(ms, "TX", packet);
+					cout << endl;
+				}
+			});
+			continue;
+		}
+
+		rxBytes += record.Length;
+		if (cfg.ascii)
+		{
+			if (!cfg.quiet) PrintText(ms, "RX", rxText, record);
+			continue;
+		}
+		// Mirror PSERIAL_Fill: a partial packet idle too long is dropped
+		if (PDECODE_Pending(&rx) < PSERIAL_PACKETSIZE && record.Nanoseconds - lastRxNs > RXTIMEOUT_NS)
+		{
+			PDECODE_Reset(&rx);
+		}
+		lastRxNs = record.Nanoseconds;
+		Decode(rx, record, [&](const PSERIAL_PACKET& packet)
+		{
+			rxPackets++;
+			LatencyStats& stats = latency[packet.Command];
+			double replyMs = -1.0;
+			auto found = sentAt.find(make_pair((int)packet.Unit, (int)packet.Command));
+			if (found != sentAt.end() && !found->second.empty())
+			{
+				replyMs = (record.Nanoseconds - found->second.front()) / 1e6;
+				found->second.pop_front();
+				stats.count++;
+				stats.totalMs += replyMs;
+				stats.maxMs = max(stats.maxMs, replyMs);
+			}
+			else
+			{
+				stats.unmatched++;
+			}
+			if (!cfg.quiet)
+			{
+				PrintPacket(ms, "RX", packet);
+				if (replyMs >= 0)
+				{
+					cout << "  after " << setprecision(3) << replyMs << " ms";
+				}
+				cout << endl;
+			}
+		});
+	}
+	double wallSeconds = chrono::duration<double>(Clock::now() - start).count();
+	PCAPTURE_Close(capture);
+
+	cout << endl << "Records:           " << records << endl;
+	cout << "Captured span:     " << fixed << setprecision(3) << (lastNs - firstNs) / 1e9 << " s" << endl;
+	cout << "Replay time:       " << wallSeconds << " s" << endl;
+	if (!cfg.ascii)
+	{
+		cout << "Packets sent:      " << txPackets << endl;
+		cout << "Replies decoded:   " << rxPackets << endl;
+		cout << "Bytes discarded:   " << rx.Discarded << endl;
+		for (const auto& entry : latency)
+		{
+			const LatencyStats& stats = entry.second;
+			cout << "Command " << setw(3) << entry.first << ": " << stats.count << " replies";
+			if (stats.count > 0)
+			{
+				cout << ", mean " << setprecision(3) << stats.totalMs / stats.count
+					<< " ms, max " << stats.maxMs << " ms";
+			}
+			if (stats.unmatched > 0)
+			{
+				cout << ", " << stats.unmatched << " unmatched";
+			}
+			cout << endl;
+		}
+	}
+	if (cfg.speed == 0 && wallSeconds > 0)
+	{
+		cout << "Decode rate:       " << setprecision(0) << rxBytes / wallSeconds << " bytes/s" << endl;
+	}
+	return 0;
+}